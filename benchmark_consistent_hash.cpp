@@ -0,0 +1,130 @@
+// Compares lookups on ConsistentHash's flat ring against lower_bound on the
+// map of points it used to keep, and routing a multiget key by key against
+// IndexesForKeys.
+//
+// Usage: benchmark_consistent_hash [--servers=10] [--batch_keys=100]
+//            [--lookups=10000000]
+
+#include "consistent_hash.h"
+#include "memdata.pb.h"
+#include "utils.h"
+
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+using router_utils::Timer;
+
+static void Report(const string& name, uint64_t lookups, const Timer& timer) {
+  double seconds = timer.GetDelay() / 1e6;
+  cout << name << ": " << static_cast<uint64_t>(lookups / seconds)
+       << " lookups/s" << endl;
+}
+
+int main(int argc, char* argv[]) {
+  router_utils::Flags flags(argc, argv);
+  int num_servers = max(1, flags.GetInt("servers", 10));
+  int batch_keys = max(1, flags.GetInt("batch_keys", 100));
+  int lookups = max(batch_keys, flags.GetInt("lookups", 10000000));
+
+  memcache_router::Instruction instruction;
+  for (int i = 0; i < num_servers; ++i) {
+    memcache_router::Server* s = instruction.add_servers();
+    s->set_hostname("10.0.0." + to_string(i + 1));
+    s->set_port(Resource::kDefaultPort);
+  }
+  ConsistentHash ring(instruction.servers());
+
+  // The ring as it was, with a copy of its server on each point.
+  map<uint32_t, Resource> points;
+  for (int i = 0; i < num_servers; ++i) {
+    Resource resource;
+    resource.server = instruction.servers(i);
+    for (int j = 0;
+         j < ConsistentHash::kPointsPerServer / ConsistentHash::kAlignment;
+         ++j) {
+      string resource_key = resource.GetKeyForPoint(j);
+      for (int alignment = 0; alignment < ConsistentHash::kAlignment;
+           ++alignment) {
+        points[ring.GetKetamaHash(resource_key, alignment)] = resource;
+      }
+    }
+  }
+  cout << num_servers << " servers, " << points.size() << " points" << endl;
+
+  mt19937 rng(0);
+  vector<uint32_t> hashes(1 << 16);
+  for (int i = 0; i < hashes.size(); ++i) {
+    hashes[i] = rng();
+  }
+  int mask = hashes.size() - 1;
+
+  // Both find the same server for every hash, and for hashes on and just
+  // past each point.
+  vector<uint32_t> checked(hashes);
+  for (auto itr = points.begin(); itr != points.end(); ++itr) {
+    checked.push_back(itr->first);
+    checked.push_back(itr->first + 1);
+  }
+  for (int i = 0; i < checked.size(); ++i) {
+    auto itr = points.lower_bound(checked[i]);
+    if (itr == points.end())
+      itr = points.begin();
+    CHECK(itr->second.server.hostname() ==
+          ring.ServerForHash(checked[i]).hostname());
+  }
+
+  // Summed so the lookups can't be optimized out.
+  uint64_t sum = 0;
+  {
+    Timer timer;
+    for (int i = 0; i < lookups; ++i) {
+      auto itr = points.lower_bound(hashes[i & mask]);
+      if (itr == points.end())
+        itr = points.begin();
+      sum += itr->second.server.port();
+    }
+    Report("map", lookups, timer);
+  }
+  {
+    Timer timer;
+    for (int i = 0; i < lookups; ++i) {
+      sum += ring.IndexForHash(hashes[i & mask]);
+    }
+    Report("flat", lookups, timer);
+  }
+
+  // With the MD5 of each key, in batches the size of a multiget.
+  vector<string> keys(hashes.size());
+  for (int i = 0; i < keys.size(); ++i) {
+    keys[i] = "key:" + to_string(hashes[i]);
+  }
+  int batches = lookups / batch_keys / 10;
+  {
+    Timer timer;
+    for (int b = 0; b < batches; ++b) {
+      for (int i = 0; i < batch_keys; ++i) {
+        sum += ring.IndexForKey(keys[(b * batch_keys + i) & mask]);
+      }
+    }
+    Report("IndexForKey", (uint64_t) batches * batch_keys, timer);
+  }
+  {
+    Timer timer;
+    vector<const string*> batch(batch_keys);
+    vector<int> indexes;
+    for (int b = 0; b < batches; ++b) {
+      for (int i = 0; i < batch_keys; ++i) {
+        batch[i] = &keys[(b * batch_keys + i) & mask];
+      }
+      ring.IndexesForKeys(batch, &indexes);
+      sum += indexes[0];
+    }
+    Report("IndexesForKeys", (uint64_t) batches * batch_keys, timer);
+  }
+  cout << "(checksum " << sum << ")" << endl;
+  return 0;
+}
@@ -2,11 +2,16 @@
 #include "memdata.pb.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <random>
 #include <thread>
+#include <unistd.h>
 using namespace std;
 
 struct ThreadPool {
@@ -26,10 +31,21 @@ static const int kMod = 10000;
 static const int kKeySize = 50;
 static const int kValSize = 1024;
 
+// Resident set size of this process. Covers everything the cache costs,
+// including allocator overhead, which its own accounting can't see.
+static uint64_t ResidentBytes() {
+  uint64_t pages = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  CHECK(f);
+  CHECK(fscanf(f, "%lu %lu", &pages, &resident) == 2);
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
 class CacheLoadtest {
  public:
   CacheLoadtest() {
-    cache_ = new Cache(2 << 30);
+    cache_ = new Cache(2ULL << 30);
     string key_fill = string(kKeySize, 'k');
     string val_fill = string(kValSize, 'v');
     for (int i = 0; i < kMod; ++i) {
@@ -37,14 +53,21 @@ class CacheLoadtest {
       ss << i;
       string key = key_fill + ss.str();
       string val = val_fill + ss.str();
-
-      memcache_router::KeyValue kv;
-      kv.set_key(key);
-      kv.set_val(val);
       data.push_back(pair<string, string>(key, val));
-      cache_->AddOrReplace(key, kv);
     }
 
+    memcache_router::KeyValue kv;
+    uint64_t before = ResidentBytes();
+    for (int i = 0; i < kMod; ++i) {
+      kv.set_key(data[i].first);
+      kv.set_val(data[i].second);
+      cache_->AddOrReplace(data[i].first, kv);
+    }
+    uint64_t used = ResidentBytes() - before;
+    uint64_t payload = data[0].first.size() + data[0].second.size();
+    cout << "Memory per item: " << used / kMod << " bytes, for "
+         << payload << " bytes of key and value" << endl;
+
     start_ = chrono::high_resolution_clock::now();
     thread_pool_ = new ThreadPool;
     for (int i = 0; i < NUM_THREADS; ++i) {
@@ -55,10 +78,12 @@ class CacheLoadtest {
   void Wait() {
     delete thread_pool_;
     auto end = chrono::high_resolution_clock::now();
-    int dur = chrono::duration_cast<chrono::seconds>(end - start_).count();
-    int count = NUM_THREADS * kTrials;
-    cout << count << " done in seconds: " << dur
-         << " at throughput of " << count / dur << " per sec" << endl;
+    int64_t dur = chrono::duration_cast<chrono::microseconds>(
+        end - start_).count();
+    int64_t count = static_cast<int64_t>(NUM_THREADS) * kTrials;
+    cout << count << " done in seconds: " << dur / 1000000.0
+         << " at throughput of " << count * 1000000 / dur << " per sec"
+         << endl;
   }
 
  private:
@@ -88,8 +113,182 @@ class CacheLoadtest {
   vector<pair<string, string> > data;
 };
 
+// Skewed reads, with a scan of keys read only once mixed in, as crawlers
+// and batch jobs do. Misses are filled in, as the router does.
+class HitRatioTest {
+ public:
+  static const int kKeys = 1 << 20;
+  static const int kRequests = 4 << 20;
+  static const int kScanEvery = 3;  // One in this many requests.
+  static constexpr double kSkew = 0.9;
+
+  HitRatioTest() : val_(kValSize, 'v'), cdf_(kKeys) {
+    double sum = 0;
+    for (int i = 0; i < kKeys; ++i) {
+      sum += 1.0 / pow(i + 1, kSkew);
+      cdf_[i] = sum;
+    }
+    for (int i = 0; i < kKeys; ++i) {
+      cdf_[i] /= sum;
+    }
+  }
+
+  void Run(bool admission) {
+    CacheOptions options;
+    options.capacity = 64 << 20;
+    options.admission = admission;
+    Cache cache(options);
+    mt19937_64 rng(1);
+    uniform_real_distribution<double> uniform(0, 1);
+    memcache_router::KeyValue kv;
+    uint64_t hits = 0, reads = 0, scanned = 0;
+
+    auto start = chrono::high_resolution_clock::now();
+    for (int i = 0; i < kRequests; ++i) {
+      string key;
+      bool scan = i % kScanEvery == 0;
+      if (scan) {
+        key = Key("scan", scanned++);
+      } else {
+        int rank = lower_bound(cdf_.begin(), cdf_.end(), uniform(rng)) -
+                   cdf_.begin();
+        key = Key("zipf", rank);
+      }
+      bool hit = cache.Get(key, &kv);
+      if (!scan) {
+        ++reads;
+        hits += hit;
+      }
+      if (!hit) {
+        kv.set_key(key);
+        kv.set_val(val_);
+        cache.AddOrReplace(key, kv);
+      }
+    }
+    auto end = chrono::high_resolution_clock::now();
+
+    memcache_router::Stats stats;
+    cache.PopulateStats(&stats);
+    cout << (admission ? "W-TinyLFU" : "CLOCK") << ": Zipf hit ratio "
+         << static_cast<double>(hits) / reads << ", rejected "
+         << stats.cache_admission_rejected().count() << ", in seconds: "
+         << chrono::duration_cast<chrono::microseconds>(
+                end - start).count() / 1000000.0
+         << endl;
+  }
+
+ private:
+  static string Key(const char* prefix, uint64_t n) {
+    stringstream ss;
+    ss << prefix << string(kKeySize, 'k') << n;
+    return ss.str();
+  }
+
+  string val_;
+  vector<double> cdf_;
+};
+
+// Values like pickled objects, repetitive but not trivially so, with and
+// without the cache compressing them.
+void CompressionTest(uint32_t compress_min_bytes) {
+  static const int kItems = 20000;
+  static const int kWords = 200;
+  mt19937_64 rng(1);
+  vector<string> words;
+  for (int i = 0; i < kWords; ++i) {
+    string word;
+    for (int j = 0; j < 3 + rng() % 8; ++j) {
+      word += 'a' + rng() % 26;
+    }
+    words.push_back(word);
+  }
+
+  CacheOptions options;
+  options.capacity = 1ULL << 30;
+  options.compress_min_bytes = compress_min_bytes;
+  Cache cache(options);
+  memcache_router::KeyValue kv;
+  uint64_t payload = 0;
+  uint64_t before = ResidentBytes();
+  for (int i = 0; i < kItems; ++i) {
+    stringstream ss;
+    while (ss.tellp() < 2048) {
+      ss << "S'" << words[rng() % kWords] << "'\np" << rng() % 100 << "\n";
+    }
+    string key = string(kKeySize, 'k') + to_string(i);
+    kv.set_val(ss.str());
+    payload += key.size() + kv.val().size();
+    cache.AddOrReplace(key, kv);
+  }
+  uint64_t used = ResidentBytes() - before;
+
+  for (int i = 0; i < kItems; ++i) {
+    CHECK(cache.Get(string(kKeySize, 'k') + to_string(i), &kv));
+  }
+  memcache_router::Stats stats;
+  cache.PopulateStats(&stats);
+  cout << "Compress from " << compress_min_bytes << " bytes: memory per item: "
+       << used / kItems << " bytes, for " << payload / kItems
+       << " bytes of key and value, ratio "
+       << stats.cache_compression().average() << ", decompress us "
+       << stats.cache_decompress_latency().average() << endl;
+}
+
+// Batches of GET keys, as workers look them up, one Get per key against a
+// MultiGet per batch. Keys are spread over much more than the CPU caches.
+void BatchTest() {
+  static const int kItems = 200000;
+  static const int kBatch = 1000;
+  static const int kBatches = 2000;
+  Cache cache(2ULL << 30);
+  memcache_router::KeyValue kv;
+  kv.set_val(string(kValSize, 'v'));
+  vector<string> keys;
+  for (int i = 0; i < kItems; ++i) {
+    keys.push_back(string(kKeySize, 'k') + to_string(i));
+    cache.AddOrReplace(keys.back(), kv);
+  }
+
+  mt19937_64 rng(1);
+  vector<memcache_router::KeyValue> kvs(kBatch);
+  vector<CacheBatchItem> items(kBatch);
+  for (int multi = 0; multi < 2; ++multi) {
+    int64_t usecs = 0;
+    for (int b = 0; b < kBatches; ++b) {
+      for (int i = 0; i < kBatch; ++i) {
+        items[i] = CacheBatchItem(&keys[rng() % kItems], &kvs[i]);
+      }
+      auto start = chrono::high_resolution_clock::now();
+      if (multi) {
+        cache.MultiGet(&items);
+      } else {
+        for (int i = 0; i < kBatch; ++i) {
+          items[i].hit = cache.Get(*items[i].key, items[i].kv);
+        }
+      }
+      usecs += chrono::duration_cast<chrono::microseconds>(
+          chrono::high_resolution_clock::now() - start).count();
+      for (int i = 0; i < kBatch; ++i) {
+        CHECK(items[i].hit);
+      }
+    }
+    cout << (multi ? "MultiGet" : "Get") << " batches of " << kBatch
+         << ": avg us per batch " << static_cast<double>(usecs) / kBatches
+         << endl;
+  }
+}
+
 int main() {
   CacheLoadtest test;
   test.Wait();
+
+  HitRatioTest hit_ratio;
+  hit_ratio.Run(false);
+  hit_ratio.Run(true);
+
+  CompressionTest(0);
+  CompressionTest(1024);
+
+  BatchTest();
   return 0;
 }
@@ -0,0 +1,162 @@
+// Runs the same GET and SET batches against memcached through libmemcached
+// and through BinaryEngine, to compare the two backends.
+//
+// Usage: benchmark_memclient <host:port>... [--threads=8] [--keys=10000]
+//            [--batch_keys=100] [--value_bytes=1024] [--seconds=5]
+//            [--connections=2]
+
+#include "binary_engine.h"
+#include "memclient.h"
+#include "memdata.pb.h"
+#include "utils.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+using namespace std;
+
+using router_utils::LatencyHistogram;
+using router_utils::Timer;
+
+struct Workload {
+  memcache_router::Instruction servers;
+  int threads;
+  int keys;
+  int batch_keys;
+  int value_bytes;
+  int seconds;
+  int connections;
+};
+
+static string KeyName(int i) {
+  return "benchmark_memclient_" + to_string(i);
+}
+
+class BackendLoadtest {
+ public:
+  // A null engine runs against libmemcached.
+  BackendLoadtest(const Workload& workload, shared_ptr<BinaryEngine> engine)
+      : workload_(workload), engine_(engine), batches_(0), misses_(0),
+        errors_(0) {}
+
+  void Run(const string& name) {
+    for (int set = 0; set < 2; ++set) {
+      latency_.Reset();
+      batches_ = misses_ = errors_ = 0;
+      Timer timer;
+      router_utils::ThreadPool pool;
+      for (int i = 0; i < workload_.threads; ++i) {
+        pool.threads.push_back(thread(&BackendLoadtest::Query, this, i, set));
+      }
+      pool.Reset();
+      double seconds = timer.GetDelay() / 1e6;
+      cout << name << (set ? " SET" : " GET") << ": "
+           << static_cast<uint64_t>(batches_ / seconds) << " batches/s, "
+           << static_cast<uint64_t>(batches_ * workload_.batch_keys / seconds)
+           << " keys/s, p50 " << latency_.Percentile(0.5) << "us, p99 "
+           << latency_.Percentile(0.99) << "us, misses " << misses_
+           << ", errors " << errors_ << endl;
+    }
+  }
+
+ private:
+  void Query(int seed, bool set) {
+    MemClient client(NULL, engine_);
+    client.Init(workload_.servers);
+    client.Warm();
+    mt19937 rng(seed);
+    string value(workload_.value_bytes, 'v');
+    uint64_t batches = 0, misses = 0, errors = 0;
+    Timer timer;
+    while (timer.GetDelay() < workload_.seconds * 1000000LL) {
+      Timer batch_timer;
+      if (set) {
+        memcache_router::Instruction instruction;
+        for (int i = 0; i < workload_.batch_keys; ++i) {
+          memcache_router::KeyValue* kv = instruction.add_set_keys();
+          kv->set_key(KeyName(rng() % workload_.keys));
+          kv->set_val(value);
+          kv->set_allow_replace(true);
+        }
+        client.SetKeys(&instruction);
+        for (int i = 0; i < instruction.set_keys_size(); ++i) {
+          if (instruction.set_keys(i).return_code() != MEMCACHED_SUCCESS)
+            ++errors;
+        }
+      } else {
+        map<string, memcache_router::KeyValue> key_to_kvalp;
+        for (int i = 0; i < workload_.batch_keys; ++i) {
+          key_to_kvalp[KeyName(rng() % workload_.keys)];
+        }
+        client.GetKeys(&key_to_kvalp, false);
+        for (auto itr = key_to_kvalp.begin(); itr != key_to_kvalp.end();
+             ++itr) {
+          if (itr->second.val().empty())
+            ++misses;
+        }
+      }
+      latency_.Increment(batch_timer.GetDelay());
+      ++batches;
+    }
+    batches_ += batches;
+    misses_ += misses;
+    errors_ += errors;
+  }
+
+  const Workload& workload_;
+  shared_ptr<BinaryEngine> engine_;
+  LatencyHistogram latency_;
+  atomic<uint64_t> batches_;
+  atomic<uint64_t> misses_;
+  atomic<uint64_t> errors_;
+};
+
+int main(int argc, char* argv[]) {
+  router_utils::Flags flags(argc, argv);
+  if (flags.positional().empty()) {
+    cerr << "Usage: " << argv[0] << " <host:port>... [--threads=8]"
+         << " [--keys=10000] [--batch_keys=100] [--value_bytes=1024]"
+         << " [--seconds=5] [--connections=2]" << endl;
+    return -1;
+  }
+  Workload workload;
+  for (int i = 0; i < flags.positional().size(); ++i) {
+    const string& server = flags.positional()[i];
+    size_t colon = server.rfind(':');
+    memcache_router::Server* s = workload.servers.add_servers();
+    s->set_hostname(server.substr(0, colon));
+    s->set_port(colon == string::npos ?
+                11211 : atoi(server.c_str() + colon + 1));
+  }
+  workload.threads = max(1, flags.GetInt("threads", 8));
+  workload.keys = max(1, flags.GetInt("keys", 10000));
+  workload.batch_keys = max(1, flags.GetInt("batch_keys", 100));
+  workload.value_bytes = max(0, flags.GetInt("value_bytes", 1024));
+  workload.seconds = max(1, flags.GetInt("seconds", 5));
+  workload.connections = max(1, flags.GetInt("connections", 2));
+
+  shared_ptr<BinaryEngine> engine = make_shared<BinaryEngine>(
+      workload.servers, workload.connections);
+  {
+    // Every key exists, so GETs all hit.
+    MemClient client(NULL, engine);
+    memcache_router::Instruction instruction;
+    string value(workload.value_bytes, 'v');
+    for (int i = 0; i < workload.keys; ++i) {
+      memcache_router::KeyValue* kv = instruction.add_set_keys();
+      kv->set_key(KeyName(i));
+      kv->set_val(value);
+      kv->set_allow_replace(true);
+    }
+    client.SetKeys(&instruction);
+  }
+
+  BackendLoadtest(workload, nullptr).Run("libmemcached");
+  BackendLoadtest(workload, engine).Run("binary");
+  return 0;
+}
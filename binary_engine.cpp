@@ -0,0 +1,532 @@
+#include "binary_engine.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <libmemcached/memcached.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+namespace {
+
+const int64_t kReplyTimeoutUs = 1000000;
+const int64_t kRetryUs = 1000000;
+const int kPollMs = 100;
+const int kMaxEvents = 64;
+const size_t kReadBytes = 256 << 10;
+// Smaller values are copied in with their commands, as an iovec of their
+// own costs more than the copy.
+const size_t kMinIovecBytes = 1024;
+
+bool IsQuiet(uint8_t opcode) {
+  return opcode == GETKQ || opcode == SETQ || opcode == ADDQ;
+}
+
+memcached_return_t ReturnCode(uint16_t status) {
+  switch (status) {
+    case STATUS_OK: return MEMCACHED_SUCCESS;
+    case STATUS_NOT_FOUND: return MEMCACHED_NOTFOUND;
+    case STATUS_EXISTS: return MEMCACHED_DATA_EXISTS;
+    case STATUS_TOO_LARGE: return MEMCACHED_E2BIG;
+    case STATUS_INVALID_ARGUMENTS: return MEMCACHED_INVALID_ARGUMENTS;
+    case STATUS_NOT_STORED: return MEMCACHED_NOTSTORED;
+    case STATUS_NON_NUMERIC: return MEMCACHED_CLIENT_ERROR;
+    case STATUS_UNKNOWN_COMMAND: return MEMCACHED_NOT_SUPPORTED;
+    case STATUS_OUT_OF_MEMORY: return MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+    default: return MEMCACHED_SERVER_ERROR;
+  }
+}
+
+void SetReturnCode(memcached_return_t rc, memcache_router::KeyValue* kv) {
+  kv->set_return_code(rc);
+  kv->set_return_error(memcached_strerror(NULL, rc));
+}
+
+}  // namespace
+
+void BinaryEngine::Batch::Add(int group, int n) {
+  lock_guard<mutex> l(m_);
+  if (pending_[group] == 0 && n > 0)
+    ++waiting_;
+  pending_[group] += n;
+}
+
+void BinaryEngine::Batch::Done(int group, int n) {
+  // Notified under the lock, as the waiter frees the batch once it's out.
+  lock_guard<mutex> l(m_);
+  pending_[group] -= n;
+  if (pending_[group] == 0) {
+    --waiting_;
+    finished_.push_back(group);
+    cv_.notify_one();
+  }
+}
+
+int BinaryEngine::Batch::Wait() {
+  unique_lock<mutex> l(m_);
+  while (finished_.empty() && waiting_ > 0) {
+    cv_.wait(l);
+  }
+  if (finished_.empty())
+    return -1;
+  int group = finished_.front();
+  finished_.pop_front();
+  return group;
+}
+
+BinaryEngine::BinaryEngine(const memcache_router::Instruction& servers,
+                           int connections_per_server)
+    : ring_(servers.servers()),
+      connections_per_server_(max(1, connections_per_server)),
+      next_connection_(0), done_(false) {
+  CHECK(servers.servers_size() > 0);
+  for (int i = 0; i < servers.servers_size(); ++i) {
+    for (int j = 0; j < connections_per_server_; ++j) {
+      connections_.push_back(new Connection(servers.servers(i).hostname(),
+                                            servers.servers(i).port()));
+    }
+  }
+  read_buffer_.resize(kReadBytes);
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  CHECK(epoll_fd_ != -1);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  CHECK(wake_fd_ != -1);
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  CHECK(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) == 0);
+  io_thread_ = thread(&BinaryEngine::Loop, this);
+}
+
+BinaryEngine::~BinaryEngine() {
+  done_ = true;
+  uint64_t one = 1;
+  CHECK(write(wake_fd_, &one, sizeof(one)) == sizeof(one));
+  io_thread_.join();
+  for (int i = 0; i < connections_.size(); ++i) {
+    if (connections_[i]->fd >= 0)
+      close(connections_[i]->fd);
+    delete connections_[i];
+  }
+  close(wake_fd_);
+  close(epoll_fd_);
+}
+
+void BinaryEngine::Warm() {
+  for (int i = 0; i < connections_.size(); ++i) {
+    unique_lock<mutex> l(connections_[i]->m);
+    if (connections_[i]->fd < 0)
+      Connect(connections_[i], &l);
+  }
+}
+
+int BinaryEngine::ServerFor(const string& key) const {
+  return ring_.IndexForKey(key);
+}
+
+void BinaryEngine::Get(const vector<memcache_router::KeyValue*>& kvs,
+                       vector<bool>* hits, const ServerDone& server_done) {
+  // Bytes rather than bits, as the I/O thread sets them.
+  vector<char> found(kvs.size(), 0);
+  hits->assign(kvs.size(), false);
+  Run(kvs, GETKQ, found.data(), [&](int server, const vector<int>& indexes) {
+    for (int i = 0; i < indexes.size(); ++i) {
+      (*hits)[indexes[i]] = found[indexes[i]];
+    }
+    if (server_done)
+      server_done(server, indexes);
+  });
+}
+
+void BinaryEngine::Store(const vector<memcache_router::KeyValue*>& kvs) {
+  Run(kvs, SETQ, NULL, nullptr);
+}
+
+void BinaryEngine::Arithmetic(const vector<memcache_router::KeyValue*>& kvs) {
+  Run(kvs, INCREMENT, NULL, nullptr);
+}
+
+void BinaryEngine::Run(const vector<memcache_router::KeyValue*>& kvs,
+                       uint8_t command, char* hits,
+                       const ServerDone& server_done) {
+  vector<const string*> keys(kvs.size());
+  for (int i = 0; i < kvs.size(); ++i) {
+    keys[i] = &kvs[i]->key();
+  }
+  vector<int> servers;
+  ring_.IndexesForKeys(keys, &servers);
+  vector<vector<int> > by_server(connections_.size() /
+                                 connections_per_server_);
+  for (int i = 0; i < kvs.size(); ++i) {
+    by_server[servers[i]].push_back(i);
+  }
+  // All servers get their share before any answer is waited on.
+  Batch batch(by_server.size());
+  for (int server = 0; server < by_server.size(); ++server) {
+    if (!by_server[server].empty())
+      Send(server, kvs, by_server[server], command, hits, &batch);
+  }
+  for (int server = batch.Wait(); server >= 0; server = batch.Wait()) {
+    if (server_done)
+      server_done(server, by_server[server]);
+  }
+}
+
+void BinaryEngine::Send(int server,
+                        const vector<memcache_router::KeyValue*>& kvs,
+                        const vector<int>& indexes, uint8_t command,
+                        char* hits, Batch* batch) {
+  Connection* connection = connections_[
+      server * connections_per_server_ +
+      next_connection_.fetch_add(1, memory_order_relaxed) %
+          connections_per_server_];
+  // Quiet commands end with a NOOP, whose reply accounts for all the ones
+  // which had nothing to say.
+  int num_ops = indexes.size() + (IsQuiet(command) ? 1 : 0);
+  batch->Add(server, num_ops);
+  {
+    unique_lock<mutex> l(connection->m);
+    if (connection->fd >= 0 || Connect(connection, &l)) {
+      Op op;
+      op.batch = batch;
+      op.server = server;
+      op.sent_us = router_utils::NowMicros();
+      for (int i = 0; i < indexes.size(); ++i) {
+        op.opaque = connection->next_opaque++;
+        op.kv = kvs[indexes[i]];
+        op.hit = hits ? hits + indexes[i] : NULL;
+        op.opcode = Encode(command, *op.kv, op.opaque, &connection->out);
+        connection->pending.push_back(op);
+      }
+      if (IsQuiet(command)) {
+        op.opaque = connection->next_opaque++;
+        op.opcode = NOOP;
+        op.kv = NULL;
+        op.hit = NULL;
+        connection->out.Noop(op.opaque);
+        connection->pending.push_back(op);
+      }
+      Flush(connection);
+      return;
+    }
+  }
+  for (int i = 0; i < indexes.size(); ++i) {
+    SetReturnCode(MEMCACHED_CONNECTION_FAILURE, kvs[indexes[i]]);
+  }
+  batch->Done(server, num_ops);
+}
+
+uint8_t BinaryEngine::Encode(uint8_t command,
+                             const memcache_router::KeyValue& kv,
+                             uint32_t opaque, RequestPacket* out) {
+  if (command == SETQ) {
+    // Same precedence as libmemcached: CAS, then add, then set.
+    uint8_t opcode = kv.cas() == 0 && !kv.allow_replace() ? ADDQ : SETQ;
+    out->Set(kv.key(), kv.val(), kv.flags(), kv.expire_in_seconds(),
+             kv.cas(), opcode, opaque, kv.val().size() >= kMinIovecBytes);
+    return opcode;
+  }
+  if (command == INCREMENT) {
+    uint8_t opcode = kv.offset() >= 0 ? INCREMENT : DECREMENT;
+    uint32_t expiry = kv.has_default_counter_val() ?
+        kv.expire_in_seconds() : kNoInitialValue;
+    out->Arithmetic(kv.key(), abs(kv.offset()), kv.default_counter_val(),
+                    expiry, opcode, opaque);
+    return opcode;
+  }
+  out->Get(kv.key(), command, opaque);
+  return command;
+}
+
+bool BinaryEngine::Connect(Connection* connection, unique_lock<mutex>* l) {
+  int64_t now = router_utils::NowMicros();
+  if (now < connection->retry_at_us)
+    return false;
+  // Also keeps anyone else from trying while the lock is let go.
+  connection->retry_at_us = now + kRetryUs;
+
+  // The lookup may block, and the I/O thread needs the lock to read.
+  l->unlock();
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* results = NULL;
+  string port = to_string(connection->port);
+  int rc = getaddrinfo(connection->host.c_str(), port.c_str(), &hints,
+                       &results);
+  l->lock();
+  if (rc != 0) {
+    cerr << "Can't resolve " << connection->host << endl;
+    return false;
+  }
+
+  // The connect doesn't block either. Requests queue up behind it, and the
+  // I/O thread writes them out once EPOLLOUT says it's through, or fails
+  // them if it isn't. Addresses which fail right away are skipped.
+  int fd = -1;
+  for (struct addrinfo* rp = results; rp != NULL; rp = rp->ai_next) {
+    fd = socket(rp->ai_family,
+                rp->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                rp->ai_protocol);
+    if (fd == -1)
+      continue;
+    if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0 ||
+        errno == EINPROGRESS) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(results);
+  if (fd == -1) {
+    cerr << "Can't connect to " << connection->host << ":"
+         << connection->port << endl;
+    return false;
+  }
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  connection->fd = fd;
+  connection->want_write = true;
+  epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT;
+  event.data.ptr = connection;
+  CHECK(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == 0);
+  return true;
+}
+
+void BinaryEngine::Flush(Connection* connection) {
+  size_t size = connection->out.Size();
+  while (connection->out_sent < size) {
+    // Like writev, but without SIGPIPE.
+    struct iovec iovecs[IOV_MAX];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iovecs;
+    message.msg_iovlen = connection->out.Iovecs(connection->out_sent, iovecs,
+                                                IOV_MAX);
+    ssize_t sent = sendmsg(connection->fd, &message,
+                           MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent > 0) {
+      connection->out_sent += sent;
+    } else if (sent < 0 && errno == EINTR) {
+      continue;
+    } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      // The I/O thread sees the connection go, and fails what's pending.
+      shutdown(connection->fd, SHUT_RDWR);
+      connection->out.Reset();
+      connection->out_sent = 0;
+      return;
+    }
+  }
+  bool drained = connection->out_sent == size;
+  if (drained) {
+    connection->out.Reset();
+    connection->out_sent = 0;
+  }
+  if (connection->want_write == drained) {
+    connection->want_write = !drained;
+    epoll_event event;
+    event.events = EPOLLIN | (drained ? 0u : (uint32_t) EPOLLOUT);
+    event.data.ptr = connection;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection->fd, &event);
+  }
+}
+
+void BinaryEngine::Loop() {
+  epoll_event events[kMaxEvents];
+  int64_t checked_us = router_utils::NowMicros();
+  while (!done_) {
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, kPollMs);
+    for (int i = 0; i < n; ++i) {
+      Connection* connection = static_cast<Connection*>(events[i].data.ptr);
+      if (!connection)
+        continue;  // Woken up to stop.
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        Read(connection);
+      if (events[i].events & EPOLLOUT) {
+        lock_guard<mutex> l(connection->m);
+        if (connection->fd >= 0)
+          Flush(connection);
+      }
+    }
+    int64_t now = router_utils::NowMicros();
+    if (now - checked_us >= kPollMs * 1000) {
+      CheckTimeouts();
+      checked_us = now;
+    }
+  }
+}
+
+void BinaryEngine::Read(Connection* connection) {
+  int fd = -1;
+  {
+    lock_guard<mutex> l(connection->m);
+    fd = connection->fd;
+  }
+  if (fd < 0)
+    return;
+  ssize_t bytes = read(fd, &read_buffer_[0], read_buffer_.size());
+  if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINTR)) {
+    return;
+  }
+  if (bytes <= 0) {
+    Fail(connection, MEMCACHED_CONNECTION_FAILURE);
+    return;
+  }
+  connection->in.append(read_buffer_.data(), bytes);
+  if (!Parse(connection)) {
+    cerr << "Bad reply from " << connection->host << ":" << connection->port
+         << endl;
+    Fail(connection, MEMCACHED_PROTOCOL_ERROR);
+  }
+}
+
+bool BinaryEngine::Parse(Connection* connection) {
+  const string& in = connection->in;
+  size_t pos = connection->in_read;
+  vector<Op> silent;
+  while (in.size() - pos >= sizeof(ProtocolHeader)) {
+    ProtocolHeader header;
+    DecodeHeader(in.data() + pos, &header);
+    if (header.magic != RESPONSE)
+      return false;
+    size_t length = sizeof(header) + header.total_body_length;
+    if (in.size() - pos < length)
+      break;
+
+    Op op;
+    silent.clear();
+    {
+      lock_guard<mutex> l(connection->m);
+      deque<Op>& pending = connection->pending;
+      // Quiet requests sent before this one had nothing to say.
+      while (!pending.empty() && pending.front().opaque != header.opaque &&
+             IsQuiet(pending.front().opcode)) {
+        silent.push_back(pending.front());
+        pending.pop_front();
+      }
+      if (pending.empty() || pending.front().opaque != header.opaque)
+        return false;
+      op = pending.front();
+      pending.pop_front();
+    }
+    for (int i = 0; i < silent.size(); ++i) {
+      CompleteSilent(silent[i]);
+    }
+    Complete(op, in.data() + pos, length);
+    pos += length;
+  }
+
+  if (pos == in.size()) {
+    connection->in.clear();
+    pos = 0;
+  } else if (pos > in.size() / 2) {
+    // Drop what's been handled, once it's most of the buffer.
+    connection->in.erase(0, pos);
+    pos = 0;
+  }
+  connection->in_read = pos;
+  return true;
+}
+
+void BinaryEngine::Fail(Connection* connection, int return_code) {
+  deque<Op> failed;
+  {
+    lock_guard<mutex> l(connection->m);
+    if (connection->fd >= 0) {
+      cerr << "Dropping connection to " << connection->host << ":"
+           << connection->port << endl;
+      close(connection->fd);  // Also takes it out of the epoll set.
+      connection->fd = -1;
+    }
+    failed.swap(connection->pending);
+    connection->out.Reset();
+    connection->out_sent = 0;
+    connection->want_write = false;
+  }
+  connection->in.clear();
+  connection->in_read = 0;
+  for (int i = 0; i < failed.size(); ++i) {
+    CompleteFailed(failed[i], return_code);
+  }
+}
+
+void BinaryEngine::CheckTimeouts() {
+  int64_t now = router_utils::NowMicros();
+  for (int i = 0; i < connections_.size(); ++i) {
+    Connection* connection = connections_[i];
+    bool expired = false;
+    {
+      lock_guard<mutex> l(connection->m);
+      expired = !connection->pending.empty() &&
+                now - connection->pending.front().sent_us > kReplyTimeoutUs;
+    }
+    if (expired)
+      Fail(connection, MEMCACHED_TIMEOUT);
+  }
+}
+
+void BinaryEngine::Complete(const Op& op, const char* reply, size_t size) {
+  ProtocolHeader header;
+  DecodeHeader(reply, &header);
+  memcache_router::KeyValue* kv = op.kv;
+  if (kv) {
+    const char* extras = reply + sizeof(header);
+    const char* value = extras + header.extra_length + header.key_length;
+    size_t body_size = size - sizeof(header);
+    size_t value_size = body_size - header.extra_length - header.key_length;
+    memcached_return_t rc = ReturnCode(header.reserved);
+    if (header.extra_length + header.key_length > body_size)
+      rc = MEMCACHED_PROTOCOL_ERROR;  // Or value_size wraps around.
+    // What libmemcached says for a failed add over the text protocol.
+    if (rc == MEMCACHED_DATA_EXISTS && (op.opcode == ADD || op.opcode == ADDQ))
+      rc = MEMCACHED_NOTSTORED;
+    if (rc == MEMCACHED_SUCCESS) {
+      if (op.hit) {
+        uint32_t flags = 0;
+        if (header.extra_length >= sizeof(flags))
+          memcpy(&flags, extras, sizeof(flags));
+        kv->set_val(value, value_size);
+        kv->set_flags(be32toh(flags));
+        kv->set_cas(header.cas);
+        *op.hit = 1;
+      } else if (op.opcode == INCREMENT || op.opcode == DECREMENT) {
+        uint64_t counter = 0;
+        if (value_size == sizeof(counter))
+          memcpy(&counter, value, sizeof(counter));
+        kv->set_counter_val(be64toh(counter));
+      }
+    }
+    SetReturnCode(rc, kv);
+  }
+  op.batch->Done(op.server, 1);
+}
+
+void BinaryEngine::CompleteSilent(const Op& op) {
+  // Quiet GETs are silent about misses, and quiet SETs about success.
+  if (op.kv && op.opcode != GETKQ)
+    SetReturnCode(MEMCACHED_SUCCESS, op.kv);
+  op.batch->Done(op.server, 1);
+}
+
+void BinaryEngine::CompleteFailed(const Op& op, int return_code) {
+  if (op.kv)
+    SetReturnCode(static_cast<memcached_return_t>(return_code), op.kv);
+  op.batch->Done(op.server, 1);
+}
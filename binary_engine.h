@@ -0,0 +1,174 @@
+#ifndef MEMCACHE_ROUTER_BINARY_ENGINE_H
+#define MEMCACHE_ROUTER_BINARY_ENGINE_H
+
+/*
+ * Talks the memcached binary protocol (see protocol.h) to a list of
+ * servers, without libmemcached.
+ *
+ * Keys go to servers by the router's ketama ring (see consistent_hash.h),
+ * same as with MemClient's libmemcached backend.
+ *
+ * Each server gets a few persistent connections, shared by all the workers.
+ * A worker encodes its part of a batch for each server onto one of its
+ * connections, writes out what the socket takes right away, and waits for
+ * the replies. A single I/O thread polls all connections with epoll,
+ * writes out whatever is left, and reads the replies. Requests are
+ * pipelined, and replies are matched back to them by opaque. So GETs go out
+ * as quiet GETKQs, which only reply on a hit, and SETs as quiet SETQs or
+ * ADDQs, which only reply on an error. Either is followed by a NOOP whose
+ * reply means every key before it has been answered. A slow server only
+ * holds up the keys sent to it.
+ *
+ * A server's part of a batch goes out in a single writev, with big values
+ * pointed at where they are rather than copied in.
+ *
+ * A connection which drops, or has a request unanswered for a second,
+ * fails everything pending on it with a connection error. The next request
+ * reconnects it, at most once a second. Requests fail right away while the
+ * host is being looked up. The connect itself doesn't block, so a server
+ * which doesn't answer only times out the requests sent to it.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "consistent_hash.h"
+#include "memdata.pb.h"
+#include "protocol.h"
+using namespace std;
+
+class BinaryEngine {
+ public:
+  // Told about each server's share of a Get, by their indexes in kvs, as
+  // soon as that server has answered them all. Runs on the caller's thread.
+  typedef function<void(int server, const vector<int>& indexes)> ServerDone;
+
+  BinaryEngine(const memcache_router::Instruction& servers,
+               int connections_per_server);
+  ~BinaryEngine();
+
+  // Connects to all the servers ahead of the first request.
+  void Warm();
+
+  // Fills in the KeyValues of the keys found, and sets hits to match. A
+  // server's hits are in by the time server_done hears about it.
+  void Get(const vector<memcache_router::KeyValue*>& kvs, vector<bool>* hits,
+           const ServerDone& server_done = nullptr);
+  // Sets each KeyValue, or adds it if allow_replace is false, or swaps it
+  // if it has a cas. Their return codes are set.
+  void Store(const vector<memcache_router::KeyValue*>& kvs);
+  // Increments counters, or decrements them for negative offsets, creating
+  // them with default_counter_val if that's set. Sets counter_val and the
+  // return code.
+  void Arithmetic(const vector<memcache_router::KeyValue*>& kvs);
+
+  // Index of the server key goes to.
+  int ServerFor(const string& key) const;
+
+ private:
+  // Replies waited on by a worker, in one group per server.
+  class Batch {
+   public:
+    explicit Batch(int num_groups) : pending_(num_groups, 0), waiting_(0) {}
+
+    void Add(int group, int n);
+    void Done(int group, int n);
+    // Returns the next group to have all its replies in, or -1 once every
+    // group has been returned.
+    int Wait();
+
+   private:
+    mutex m_;
+    condition_variable cv_;
+    vector<int> pending_;
+    int waiting_;  // Groups with replies pending.
+    deque<int> finished_;
+  };
+
+  // A request on the wire.
+  struct Op {
+    uint32_t opaque;
+    uint8_t opcode;
+    memcache_router::KeyValue* kv;  // NULL for NOOPs.
+    char* hit;  // Gets only.
+    Batch* batch;
+    int server;  // Its group in the batch.
+    int64_t sent_us;
+  };
+
+  struct Connection {
+    Connection(const string& host, int port)
+        : host(host), port(port), fd(-1), retry_at_us(0), next_opaque(0),
+          out_sent(0), want_write(false), in_read(0) {}
+
+    const string host;
+    const int port;
+
+    mutex m;
+    int fd;  // -1 while down. Only closed by the I/O thread.
+    int64_t retry_at_us;  // Don't connect again before this.
+    uint32_t next_opaque;
+    // Requests from out_sent on aren't written yet. Points at the bytes of
+    // the big values of SETs, which their workers keep until the replies
+    // are in. Values before out_sent may be gone.
+    RequestPacket out;
+    size_t out_sent;
+    bool want_write;  // Polled for EPOLLOUT.
+    deque<Op> pending;  // In the order sent.
+
+    // Only touched by the I/O thread.
+    string in;
+    size_t in_read;
+  };
+
+  // Sends the kvs of each server as commands of the given kind (GETKQ,
+  // SETQ or INCREMENT), and waits for the replies.
+  void Run(const vector<memcache_router::KeyValue*>& kvs, uint8_t command,
+           char* hits, const ServerDone& server_done);
+  // Queues the commands on one of the server's connections, and writes
+  // them out. They fail right away if it can't connect.
+  void Send(int server, const vector<memcache_router::KeyValue*>& kvs,
+            const vector<int>& indexes, uint8_t command, char* hits,
+            Batch* batch);
+  // Appends the command for kv, and returns its opcode.
+  static uint8_t Encode(uint8_t command, const memcache_router::KeyValue& kv,
+                        uint32_t opaque, RequestPacket* out);
+
+  // Call with connection->m held, through l for Connect, which lets go of
+  // it while looking up the host.
+  bool Connect(Connection* connection, unique_lock<mutex>* l);
+  void Flush(Connection* connection);
+
+  void Loop();
+  void Read(Connection* connection);
+  // Handles the complete replies in connection->in. False if the stream
+  // doesn't make sense.
+  bool Parse(Connection* connection);
+  void Fail(Connection* connection, int return_code);
+  void CheckTimeouts();
+
+  // reply is the whole response, of size bytes.
+  static void Complete(const Op& op, const char* reply, size_t size);
+  // Ops which never got a reply.
+  static void CompleteSilent(const Op& op);
+  static void CompleteFailed(const Op& op, int return_code);
+
+  const ConsistentHash ring_;
+  const int connections_per_server_;
+  vector<Connection*> connections_;  // connections_per_server_ per server.
+  atomic<uint32_t> next_connection_;
+  int epoll_fd_;
+  int wake_fd_;  // Stops the I/O thread.
+  vector<char> read_buffer_;  // Only touched by the I/O thread.
+  atomic_bool done_;
+  thread io_thread_;
+};
+
+#endif
@@ -0,0 +1,48 @@
+// Checks ConsistentHash against the ketama.py implementation.
+
+#include <iostream>
+
+#include "consistent_hash.h"
+#include "utils.h"
+using namespace std;
+
+int main() {
+  memcache_router::Instruction instruction;
+  for (int i = 0; i < 5; ++i) {
+    memcache_router::Server* s = instruction.add_servers();
+    s->set_hostname(string(1, 'a' + i));
+    s->set_port(Resource::kDefaultPort);
+  }
+
+  ConsistentHash h(instruction.servers());
+  // The following 3 are checking against ketama python implementation ketama.py
+  CHECK(h.GetKetamaHash("manish", 0) == 2303838553);
+  CHECK(h.GetKetamaHash("rai", 0) == 4198501049);
+  CHECK(h.GetKetamaHash("jain", 0) == 901215935);
+  cout << "Ketama hash OK" << endl;
+
+
+  CHECK(h.ServerForKey("a").hostname() == "e");
+  CHECK(h.ServerForKey("ab").hostname() == "b");
+  CHECK(h.ServerForKey("abc").hostname() == "c");
+  CHECK(h.ServerForKey("abcd").hostname() == "e");
+  CHECK(h.ServerForKey("abcde").hostname() == "c");
+  cout << "Server for key OK" << endl;
+
+  vector<string> keys;
+  vector<const string*> batch;
+  for (int i = 0; i < 1000; ++i) {
+    keys.push_back("key" + to_string(i));
+  }
+  for (int i = 0; i < keys.size(); ++i) {
+    batch.push_back(&keys[i]);
+  }
+  vector<int> indexes;
+  h.IndexesForKeys(batch, &indexes);
+  for (int i = 0; i < keys.size(); ++i) {
+    CHECK(indexes[i] == h.IndexForKey(keys[i]));
+    CHECK(h.ServerForKey(keys[i]).hostname() == string(1, 'a' + indexes[i]));
+  }
+  cout << "Indexes for keys OK" << endl;
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include "cmrclient.h"
 
+#include <algorithm>
 #include <iostream>
 #include <zmq.h>
 #include <zlib.h>
@@ -7,7 +8,7 @@
 #include "utils.h"
 using namespace std;
 
-Client::Client(const std::string& id) {
+Client::Client(const std::string& id) : num_frontends_(1) {
   cpickle_ = PyImport_ImportModule("cPickle");
   CHECK(cpickle_);
 
@@ -39,6 +40,17 @@ Client::~Client() {
   Py_DECREF(zlib_);
 }
 
+// Frontend i of the router listens on 5555 + 2 * i and 5556 + 2 * i.
+void Client::connect_frontends(int num_frontends) {
+  for (int i = num_frontends_; i < num_frontends; ++i) {
+    string req = "tcp://localhost:" + to_string(5555 + 2 * i);
+    string async = "tcp://localhost:" + to_string(5556 + 2 * i);
+    CHECK(zmq_connect(req_socket_, req.c_str()) == 0);
+    CHECK(zmq_connect(async_socket_, async.c_str()) == 0);
+  }
+  num_frontends_ = max(num_frontends_, num_frontends);
+}
+
 void Client::reset_hosts() {
   host_list_.Clear();
 }
@@ -103,9 +115,8 @@ void Client::GetInternal(const vector<std::string>& keys,
   for (std::string k : keys) {
     i.add_get_keys()->set_key(k);
   }
-  string data;
-  CHECK(i.SerializeToString(&data));
-  router_utils::SendHelper(req_socket_, data, 0);
+  i.set_value_frames(true);
+  router_utils::SendMessage(req_socket_, i, 0);
 
   zmq_msg_t message;
   int rc = zmq_msg_init(&message);
@@ -114,7 +125,27 @@ void Client::GetInternal(const vector<std::string>& keys,
   CHECK(rc != -1);
   CHECK(response->ParseFromArray(
       zmq_msg_data(&message), zmq_msg_size(&message)));
+  int more = zmq_msg_more(&message);
   zmq_msg_close(&message);
+
+  // Big cached values follow as frames of their own, in key order.
+  int key = 0;
+  for (int frame = 1; more; ++frame) {
+    rc = zmq_msg_init(&message);
+    CHECK(rc == 0);
+    rc = zmq_msg_recv(&message, req_socket_, 0);
+    CHECK(rc != -1);
+    while (response->get_keys(key).val_frame() != frame) {
+      ++key;
+      CHECK(key < response->get_keys_size());
+    }
+    memcache_router::KeyValue* kv = response->mutable_get_keys(key);
+    kv->set_val(static_cast<char*>(zmq_msg_data(&message)),
+                zmq_msg_size(&message));
+    kv->clear_val_frame();
+    more = zmq_msg_more(&message);
+    zmq_msg_close(&message);
+  }
 }
 
 // TODO(manish): Set the expiry properly.
@@ -148,9 +179,7 @@ void Client::SetInternal(const string& key, PyObject* val, uint64_t time,
   kv->set_allow_replace(replace);
   // kv->set_no_propagate(..)
 
-  string data;
-  CHECK(i.SerializeToString(&data));
-  router_utils::SendHelper(async_socket_, data, 0);
+  router_utils::SendMessage(async_socket_, i, 0);
   // cout << "Set Internal us: " << prepare_val_lap
   //      << " " << timer.GetDelay() << endl;
 }
@@ -161,9 +190,7 @@ uint64_t Client::incr(const string& key, int offset) {
   kv->set_key(key);
   kv->set_offset(offset);
 
-  string data;
-  CHECK(i.SerializeToString(&data));
-  router_utils::SendHelper(req_socket_, data, 0);
+  router_utils::SendMessage(req_socket_, i, 0);
 
   memcache_router::Instruction response;
   zmq_msg_t message;
@@ -21,6 +21,10 @@ class Client {
   void add_host(const string& hostname, int port);
   void send_host_list();
 
+  // Connects to the router's other frontends as well, so requests get
+  // spread across them round robin. The router must run at least this many.
+  void connect_frontends(int num_frontends);
+
   PyObject* get(const string& key);
   PyObject* gets(const string& key);
   PyObject* get_multi(const vector<string>& keys);
@@ -68,6 +72,7 @@ class Client {
   void* async_socket_;
   void* context_;
   void* req_socket_;
+  int num_frontends_;
 };
 
 #endif
@@ -1,39 +1,62 @@
 #include "utils.h"
 #include <iostream>
+#include <map>
 #include <openssl/md5.h>
 
 #include "consistent_hash.h"
 
-const int kPointsPerServer = 160;
-const int kAlignment = 4;
-
 // TODO(manish): These defaults and this algorithm doesn't match with hosts.cc
 // from libmemcached. This logic is based upon ketama.py. Revisit later.
 ConsistentHash::ConsistentHash(
-    const RepeatedPtrField<memcache_router::Server>& servers) {
-  for (int i = 0; i < servers.size(); ++i) {
+    const RepeatedPtrField<memcache_router::Server>& servers)
+    : servers_(servers.begin(), servers.end()) {
+  CHECK(servers_.size() <= UINT16_MAX);
+  // Points of two servers may collide. The later server takes it, as in
+  // ketama.py.
+  map<uint32_t, int> ring;
+  for (int i = 0; i < servers_.size(); ++i) {
     Resource resource;
-    resource.server.CopyFrom(servers.Get(i));
+    resource.server = servers_[i];
 
     for (int j = 0; j < kPointsPerServer / kAlignment; ++j) {
       string resource_key = resource.GetKeyForPoint(j);
 
       for (int alignment = 0; alignment < kAlignment; ++alignment) {
-        uint32_t pos = GetKetamaHash(resource_key, alignment);
-        CHECK(resources_.insert(pair<uint32_t, Resource>(
-            pos, resource)).second);
+        ring[GetKetamaHash(resource_key, alignment)] = i;
       }
     }
   }
+
+  vector<pair<uint32_t, int> > sorted(ring.begin(), ring.end());
+  points_.resize(sorted.size() + 1);
+  indexes_.resize(sorted.size() + 1);
+  Layout(sorted, 0, 1);
+  indexes_[0] = sorted.empty() ? 0 : sorted[0].second;
+}
+
+size_t ConsistentHash::Layout(const vector<pair<uint32_t, int> >& sorted,
+                              size_t i, size_t k) {
+  if (k < points_.size()) {
+    i = Layout(sorted, i, 2 * k);
+    points_[k] = sorted[i].first;
+    indexes_[k] = sorted[i].second;
+    i = Layout(sorted, i + 1, 2 * k + 1);
+  }
+  return i;
 }
 
-const memcache_router::Server&
-    ConsistentHash::ServerForHash(uint32_t hash) const {
-  auto itr = resources_.lower_bound(hash);
-  if (itr == resources_.end()) {
-    itr = resources_.begin();
+void ConsistentHash::IndexesForKeys(const vector<const string*>& keys,
+                                    vector<int>* indexes) const {
+  // Hashing them all first leaves the walks independent of each other, so
+  // the CPU can overlap them.
+  vector<uint32_t> hashes(keys.size());
+  for (int i = 0; i < keys.size(); ++i) {
+    hashes[i] = GetKetamaHash(*keys[i], 0);
+  }
+  indexes->resize(keys.size());
+  for (int i = 0; i < hashes.size(); ++i) {
+    (*indexes)[i] = IndexForHash(hashes[i]);
   }
-  return itr->second.server;
 }
 
 uint32_t ConsistentHash::GetKetamaHash(const string& key, int alignment) const {
@@ -45,29 +68,3 @@ uint32_t ConsistentHash::GetKetamaHash(const string& key, int alignment) const {
     | ((uint32_t) (digest[1 + alignment * 4] & 0xFF) << 8)
     | (digest[0 + alignment * 4] & 0xFF);
 }
-
-int main() {
-  memcache_router::Instruction instruction;
-  for (int i = 0; i < 5; ++i) {
-    memcache_router::Server* s = instruction.add_servers();
-    char host = 'a' + i;
-    s->set_hostname(&host);
-    s->set_port(1);
-  }
-
-  ConsistentHash h(instruction.servers());
-  // The following 3 are checking against ketama python implementation ketama.py
-  CHECK(h.GetKetamaHash("manish", 0) == 2303838553);
-  CHECK(h.GetKetamaHash("rai", 0) == 4198501049);
-  CHECK(h.GetKetamaHash("jain", 0) == 901215935);
-  cout << "Ketama hash OK" << endl;
-
-
-  CHECK(h.ServerForKey("a").hostname() == "e");
-  CHECK(h.ServerForKey("ab").hostname() == "b");
-  CHECK(h.ServerForKey("abc").hostname() == "c");
-  CHECK(h.ServerForKey("abcd").hostname() == "e");
-  CHECK(h.ServerForKey("abcde").hostname() == "c");
-  cout << "Server for key OK" << endl;
-  return 0;
-}
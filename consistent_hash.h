@@ -1,39 +1,87 @@
+#ifndef MEMCACHE_ROUTER_CONSISTENT_HASH_H
+#define MEMCACHE_ROUTER_CONSISTENT_HASH_H
+
+#include <cstdint>
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include "memdata.pb.h"
 using namespace std;
 using google::protobuf::RepeatedPtrField;
 
 struct Resource {
-  Resource() : position(-1) {}
-
   memcache_router::Server server;
-  int position;
 
+  // Like libmemcached's ketama, the port only goes in when it isn't the
+  // default, so servers on one host get points of their own.
   string GetKeyForPoint(int point) {
     stringstream ss;
     ss << server.hostname();
+    if (server.port() != kDefaultPort)
+      ss << ":" << server.port();
     ss << "-";
     ss << point;
     return ss.str();
   }
+
+  static const int kDefaultPort = 11211;
 };
 
+// The ring is kept as a flat array of its points in Eytzinger (BFS) order,
+// with the index of each point's server in a parallel array. A lookup walks
+// it from the root without branching on the comparisons, and the first few
+// levels it always touches share a couple of cache lines.
 class ConsistentHash {
  public:
+  static const int kPointsPerServer = 160;
+  static const int kAlignment = 4;  // Points per MD5 digest.
+
   explicit ConsistentHash(
       const RepeatedPtrField<memcache_router::Server>& servers);
 
   uint32_t GetKetamaHash(const string& key, int alignment) const;
-  const memcache_router::Server& ServerForHash(uint32_t hash) const;
+  const memcache_router::Server& ServerForHash(uint32_t hash) const {
+    return servers_[IndexForHash(hash)];
+  }
 
   const memcache_router::Server& ServerForKey(const string& key) const {
     uint32_t hash = GetKetamaHash(key, 0);
     return ServerForHash(hash);
   }
 
+  // Index of the server for the first point at or after hash, in the list
+  // the ring was built from.
+  int IndexForHash(uint32_t hash) const {
+    size_t k = 1;
+    while (k < points_.size())
+      k = 2 * k + (points_[k] < hash);
+    // Undo the right turns taken since the last left one, which was at the
+    // point found. With none, hash is past the last point, and k becomes 0,
+    // which wraps around to the first.
+    k >>= __builtin_ffsll(~k);
+    return indexes_[k];
+  }
+
+  int IndexForKey(const string& key) const {
+    return IndexForHash(GetKetamaHash(key, 0));
+  }
+
+  // Indexes of the servers for all the keys of a multiget.
+  void IndexesForKeys(const vector<const string*>& keys,
+                      vector<int>* indexes) const;
+
  private:
-  map<uint32_t, Resource> resources_;
+  // Lays out sorted points from i on as the subtree at k. Returns the
+  // point after its last.
+  size_t Layout(const vector<pair<uint32_t, int> >& sorted, size_t i,
+                size_t k);
+
+  vector<memcache_router::Server> servers_;
+  // Both 1-based. points_[0] is unused, and indexes_[0] is the server of
+  // the smallest point.
+  vector<uint32_t> points_;
+  vector<uint16_t> indexes_;
 };
 
+#endif
@@ -0,0 +1,91 @@
+#include "epoch.h"
+
+#include "utils.h"
+
+namespace {
+
+atomic<bool> used_ids[kMaxEpochThreads];
+atomic<int> high_water(0);
+
+// Gives the id back when its thread exits.
+struct ThreadId {
+  ThreadId() : id(-1) {}
+
+  ~ThreadId() {
+    if (id >= 0)
+      used_ids[id].store(false, memory_order_release);
+  }
+
+  int id;
+};
+
+thread_local ThreadId thread_id;
+
+}  // namespace
+
+int ThreadSlot::Id() {
+  if (thread_id.id >= 0)
+    return thread_id.id;
+
+  for (int i = 0; i < kMaxEpochThreads; ++i) {
+    bool expected = false;
+    if (!used_ids[i].load(memory_order_relaxed) &&
+        used_ids[i].compare_exchange_strong(expected, true)) {
+      thread_id.id = i;
+      break;
+    }
+  }
+  CHECK(thread_id.id >= 0);  // Too many threads.
+
+  int seen = high_water.load();
+  while (seen <= thread_id.id &&
+         !high_water.compare_exchange_weak(seen, thread_id.id + 1)) {}
+  return thread_id.id;
+}
+
+int ThreadSlot::HighWater() {
+  return high_water.load();
+}
+
+EpochManager::EpochManager() : epoch_(1) {
+  for (int i = 0; i < kMaxEpochThreads; ++i) {
+    locals_[i].epoch.store(kIdle, memory_order_relaxed);
+  }
+}
+
+uint64_t EpochManager::SafeEpoch() {
+  // Orders the writer's unlinking stores before the scan. Paired with the
+  // seq_cst store in Enter, either the scan sees a reader, or the reader
+  // sees the object gone.
+  atomic_thread_fence(memory_order_seq_cst);
+  uint64_t current = epoch_.load(memory_order_relaxed);
+  uint64_t oldest = current;
+  int num_threads = ThreadSlot::HighWater();
+  for (int i = 0; i < num_threads; ++i) {
+    uint64_t epoch = locals_[i].epoch.load(memory_order_relaxed);
+    if (epoch < oldest)
+      oldest = epoch;
+  }
+  if (oldest == current)
+    epoch_.compare_exchange_strong(current, current + 1);
+  return oldest;
+}
+
+RetireList::~RetireList() {
+  for (int i = 0; i < retired_.size(); ++i) {
+    retired_[i].deleter(retired_[i].object);
+  }
+}
+
+void RetireList::Reclaim() {
+  uint64_t safe = epochs_->SafeEpoch();
+  int kept = 0;
+  for (int i = 0; i < retired_.size(); ++i) {
+    if (retired_[i].epoch < safe) {
+      retired_[i].deleter(retired_[i].object);
+    } else {
+      retired_[kept++] = retired_[i];
+    }
+  }
+  retired_.resize(kept);
+}
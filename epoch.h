@@ -0,0 +1,127 @@
+#ifndef MEMCACHE_ROUTER_EPOCH_H
+#define MEMCACHE_ROUTER_EPOCH_H
+
+/*
+ * Epoch based reclamation, for data structures read without locks.
+ *
+ * Readers pin the current epoch for as long as they look at shared
+ * objects. Writers retire objects instead of freeing them, tagged with the
+ * epoch they were retired in, and an object is freed only once every reader
+ * still pinned has moved past that epoch. The epoch advances when all
+ * pinned readers have caught up with it.
+ *
+ * Reads cost two stores to a cache line owned by the reading thread, so
+ * readers never contend with each other.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "mpmc_queue.h"  // kCacheLineSize
+using namespace std;
+
+const int kMaxEpochThreads = 512;
+
+// Small dense ids for live threads, reused once a thread exits.
+class ThreadSlot {
+ public:
+  // Id of the calling thread, in [0, kMaxEpochThreads).
+  static int Id();
+  // One past the highest id handed out so far.
+  static int HighWater();
+};
+
+class EpochManager {
+ public:
+  EpochManager();
+
+  void Enter() {
+    Local& local = locals_[ThreadSlot::Id()];
+    // Announce, then let writers see it before touching anything shared.
+    local.epoch.store(epoch_.load(memory_order_relaxed), memory_order_seq_cst);
+  }
+
+  void Exit() {
+    locals_[ThreadSlot::Id()].epoch.store(kIdle, memory_order_release);
+  }
+
+  uint64_t Current() const {
+    return epoch_.load(memory_order_acquire);
+  }
+
+  // Returns the oldest epoch a pinned reader may still be in. Objects
+  // retired before it are free to go. Moves the epoch on, if every pinned
+  // reader has caught up with it.
+  uint64_t SafeEpoch();
+
+ private:
+  static const uint64_t kIdle = UINT64_MAX;
+
+  struct Local {
+    atomic<uint64_t> epoch;
+    char pad[kCacheLineSize - sizeof(atomic<uint64_t>)];
+  };
+
+  atomic<uint64_t> epoch_;
+  char pad_[kCacheLineSize - sizeof(atomic<uint64_t>)];
+  Local locals_[kMaxEpochThreads];
+};
+
+// Pins the epoch for the lifetime of the guard.
+class EpochGuard {
+ public:
+  explicit EpochGuard(EpochManager* epochs) : epochs_(epochs) {
+    epochs_->Enter();
+  }
+
+  ~EpochGuard() {
+    epochs_->Exit();
+  }
+
+ private:
+  EpochManager* epochs_;
+};
+
+// Objects waiting for readers to move on. Not thread safe, meant to be
+// owned by whoever serializes the writers.
+class RetireList {
+ public:
+  explicit RetireList(EpochManager* epochs) : epochs_(epochs) {}
+
+  // Frees everything, there must be no readers left.
+  ~RetireList();
+
+  template <typename T>
+  void Retire(T* object) {
+    Retired r;
+    r.epoch = epochs_->Current();
+    r.object = object;
+    r.deleter = &Delete<T>;
+    retired_.push_back(r);
+    if (retired_.size() % kReclaimEvery == 0)
+      Reclaim();
+  }
+
+  // Frees what no reader can see anymore.
+  void Reclaim();
+
+ private:
+  static const int kReclaimEvery = 64;
+
+  struct Retired {
+    uint64_t epoch;
+    void* object;
+    void (*deleter)(void*);
+  };
+
+  template <typename T>
+  static void Delete(void* object) {
+    T::Destroy(static_cast<T*>(object));
+  }
+
+  EpochManager* epochs_;
+  vector<Retired> retired_;
+};
+
+#endif
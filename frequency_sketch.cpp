@@ -0,0 +1,81 @@
+#include "frequency_sketch.h"
+
+namespace {
+
+const size_t kMinCounters = 1024;
+const int kSamplesPerCounter = 10;
+
+// Odd multipliers, one per row.
+const uint64_t kSeeds[] = {
+  0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+  0x165667B19E3779F9ULL, 0xFF51AFD7ED558CCDULL,
+};
+
+}  // namespace
+
+FrequencySketch::FrequencySketch(size_t num_counters) : additions_(0) {
+  size_t counters = kMinCounters;
+  while (counters < num_counters)
+    counters *= 2;
+  num_words_ = counters / kCountersPerWord;
+  counter_mask_ = counters - 1;
+  table_ = new atomic<uint64_t>[num_words_];
+  for (size_t i = 0; i < num_words_; ++i) {
+    table_[i].store(0, memory_order_relaxed);
+  }
+  sample_size_ = counters * kSamplesPerCounter;
+}
+
+FrequencySketch::~FrequencySketch() {
+  delete[] table_;
+}
+
+size_t FrequencySketch::IndexOf(uint64_t hash, int row) const {
+  uint64_t h = (hash + kSeeds[row]) * kSeeds[row];
+  return (h ^ (h >> 32)) & counter_mask_;
+}
+
+void FrequencySketch::Increment(uint64_t hash) {
+  bool added = false;
+  for (int row = 0; row < kDepth; ++row) {
+    size_t index = IndexOf(hash, row);
+    atomic<uint64_t>& word = table_[index / kCountersPerWord];
+    int shift = (index % kCountersPerWord) * 4;
+    uint64_t w = word.load(memory_order_relaxed);
+    while (((w >> shift) & 0xF) != 0xF) {
+      if (word.compare_exchange_weak(w, w + (1ULL << shift),
+                                     memory_order_relaxed)) {
+        added = true;
+        break;
+      }
+    }
+  }
+  // Exactly one thread sees the count go past the sample size.
+  if (added &&
+      additions_.fetch_add(1, memory_order_relaxed) + 1 == sample_size_) {
+    Halve();
+    additions_.fetch_sub(sample_size_ / 2, memory_order_relaxed);
+  }
+}
+
+int FrequencySketch::Frequency(uint64_t hash) const {
+  int frequency = 0xF;
+  for (int row = 0; row < kDepth; ++row) {
+    size_t index = IndexOf(hash, row);
+    uint64_t w = table_[index / kCountersPerWord].load(memory_order_relaxed);
+    int count = (w >> ((index % kCountersPerWord) * 4)) & 0xF;
+    if (count < frequency)
+      frequency = count;
+  }
+  return frequency;
+}
+
+void FrequencySketch::Halve() {
+  for (size_t i = 0; i < num_words_; ++i) {
+    uint64_t w = table_[i].load(memory_order_relaxed);
+    // Shifting the whole word drags each counter's low bit into its
+    // neighbour's top bit, the mask drops those.
+    while (!table_[i].compare_exchange_weak(
+               w, (w >> 1) & 0x7777777777777777ULL, memory_order_relaxed)) {}
+  }
+}
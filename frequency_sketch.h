@@ -0,0 +1,52 @@
+#ifndef MEMCACHE_ROUTER_FREQUENCY_SKETCH_H
+#define MEMCACHE_ROUTER_FREQUENCY_SKETCH_H
+
+/*
+ * Count-min sketch of how often keys were asked for, as TinyLFU uses it to
+ * decide admission.
+ *
+ * Counters are 4 bits, 16 to a word, and a key has one in each of 4 rows.
+ * Its estimate is the smallest of them. Once there have been 10 increments
+ * per counter, every counter is halved, so the sketch ages out what was
+ * popular a while ago.
+ *
+ * Safe to use from any thread without locks. Increments racing on the same
+ * word retry, while a halving racing with increments may lose a few of
+ * them, which an estimate can afford.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+
+class FrequencySketch {
+ public:
+  // Rounded up to a power of 2.
+  explicit FrequencySketch(size_t num_counters);
+  ~FrequencySketch();
+
+  void Increment(uint64_t hash);
+  // Estimate, up to 15.
+  int Frequency(uint64_t hash) const;
+
+  size_t Bytes() const {
+    return num_words_ * sizeof(atomic<uint64_t>);
+  }
+
+ private:
+  static const int kDepth = 4;
+  static const int kCountersPerWord = 16;
+
+  // Counter of the hash in row.
+  size_t IndexOf(uint64_t hash, int row) const;
+  void Halve();
+
+  size_t num_words_;
+  size_t counter_mask_;
+  atomic<uint64_t>* table_;
+  uint64_t sample_size_;
+  atomic<uint64_t> additions_;
+};
+
+#endif
@@ -1,87 +1,925 @@
 #include "lru_cache.h"
 
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <zlib.h>
 
-Cache::Cache(uint64_t capacity) : hits_(0), miss_(0) {
-  threshold_ = max(capacity / kNumBuckets, static_cast<uint64_t>(10 << 20));
+#include "utils.h"
+
+namespace {
+
+const int kInitialGroups = 64;
+
+// Memcached takes expiries longer than 30 days as unix times.
+const uint64_t kMaxRelativeExpiry = 60 * 60 * 24 * 30;
+
+// Admission sketches get a counter per this many bytes of capacity, a few
+// per entry for items of a KB or less.
+const uint64_t kBytesPerSketchCounter = 256;
+
+uint8_t TagOf(uint64_t hash) {
+  return hash >> 57;
+}
+
+// First group to probe, once masked.
+size_t GroupOf(uint64_t hash) {
+  return hash;
+}
+
+// Bit i is set if tags[i] == tag, for the kGroupSize tags of a group.
+uint32_t MatchTag(const uint8_t* tags, uint8_t tag) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < kGroupSize; ++i) {
+    if (tags[i] == tag)
+      mask |= 1 << i;
+  }
+  return mask;
+#endif
+}
+
+// Bit i is set if tags[i] is empty or deleted.
+uint32_t MatchFree(const uint8_t* tags) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags));
+  return _mm_movemask_epi8(group);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < kGroupSize; ++i) {
+    if (tags[i] & 0x80)
+      mask |= 1 << i;
+  }
+  return mask;
+#endif
+}
+
+// MurmurHash64A. Every bit of the key affects every bit of the hash, which
+// std::hash doesn't promise, and the bucket, group and tag each take their
+// own bits of it.
+uint64_t HashKey(const string& k) {
+  const uint64_t m = 0xC6A4A7935BD1E995ULL;
+  const int r = 47;
+  size_t len = k.size();
+  uint64_t h = 0x8445D61A4E774912ULL ^ (len * m);
+
+  const char* data = k.data();
+  const char* end = data + (len & ~static_cast<size_t>(7));
+  for (; data != end; data += 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    word *= m;
+    word ^= word >> r;
+    word *= m;
+    h ^= word;
+    h *= m;
+  }
+
+  const unsigned char* tail = reinterpret_cast<const unsigned char*>(data);
+  switch (len & 7) {
+    case 7: h ^= static_cast<uint64_t>(tail[6]) << 48;  // fall through
+    case 6: h ^= static_cast<uint64_t>(tail[5]) << 40;  // fall through
+    case 5: h ^= static_cast<uint64_t>(tail[4]) << 32;  // fall through
+    case 4: h ^= static_cast<uint64_t>(tail[3]) << 24;  // fall through
+    case 3: h ^= static_cast<uint64_t>(tail[2]) << 16;  // fall through
+    case 2: h ^= static_cast<uint64_t>(tail[1]) << 8;  // fall through
+    case 1: h ^= static_cast<uint64_t>(tail[0]);
+            h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+int DefaultBuckets() {
+  int cores = thread::hardware_concurrency();
+  return min(max(4 * cores, kMinBuckets), kMaxBuckets);
+}
+
+}  // namespace
+
+Entry* Entry::Create(SlabAllocator* slabs, const string& k, uint64_t hash,
+                     const memcache_router::KeyValue& kv,
+                     const string* compressed, uint32_t expire_at) {
+  const string& val = compressed ? *compressed : kv.val();
+  return Create(slabs, k, hash, val.data(), val.size(), kv.flags(), kv.cas(),
+                compressed != NULL, expire_at);
+}
+
+Entry* Entry::Create(SlabAllocator* slabs, const string& k, uint64_t hash,
+                     const char* value, uint32_t value_size, uint32_t flags,
+                     uint64_t cas, bool compressed, uint32_t expire_at) {
+  uint8_t slab_class = 0;
+  void* memory = slabs->Allocate(sizeof(Entry) + k.size() + value_size,
+                                 &slab_class);
+  Entry* entry = new (memory) Entry;
+  entry->slab_class = slab_class;
+  entry->timer.expire_at = expire_at;
+  entry->hash = hash;
+  entry->cas = cas;
+  entry->flags = flags;
+  entry->key_size = k.size();
+  entry->value_size = value_size;
+  entry->refs.store(1, memory_order_relaxed);
+  entry->referenced.store(1, memory_order_relaxed);
+  entry->in_window = false;
+  entry->compressed = compressed;
+  char* data = reinterpret_cast<char*>(entry + 1);
+  memcpy(data, k.data(), k.size());
+  memcpy(data + k.size(), value, value_size);
+  return entry;
+}
+
+void Entry::Destroy(Entry* entry) {
+  Unref(entry);
+}
+
+void Entry::Unref(Entry* entry) {
+  if (entry->refs.fetch_sub(1, memory_order_acq_rel) != 1)
+    return;
+  uint8_t slab_class = entry->slab_class;
+  entry->~Entry();
+  SlabAllocator::Free(entry, slab_class);
+}
+
+bool Entry::KeyEquals(const string& k) const {
+  return k.size() == key_size && memcmp(key(), k.data(), key_size) == 0;
+}
+
+Table* Table::Create(size_t num_groups) {
+  Table* table = new Table;
+  table->num_groups = num_groups;
+  table->tags = new uint8_t[table->capacity()];
+  memset(table->tags, kEmpty, table->capacity());
+  table->slots = new atomic<Entry*>[table->capacity()];
+  for (size_t i = 0; i < table->capacity(); ++i) {
+    table->slots[i].store(NULL, memory_order_relaxed);
+  }
+  return table;
+}
+
+void Table::Destroy(Table* table) {
+  delete[] table->tags;
+  delete[] table->slots;
+  delete table;
+}
+
+Bucket::Bucket(EpochManager* epochs, SlabAllocator* slabs, uint32_t now,
+               size_t sketch_counters)
+    : slabs(slabs), table(Table::Create(kInitialGroups)), size(0), deleted(0),
+      clock_hand(0), memory(table.load()->Bytes()), retired(epochs),
+      wheel(now), sketch(NULL), window_bytes(0), window_size(0),
+      lock_acquisitions(0), lock_contended(0), lock_hold_ns(0) {
+  if (sketch_counters > 0) {
+    sketch = new FrequencySketch(sketch_counters);
+    memory += sketch->Bytes();
+  }
+}
+
+Bucket::~Bucket() {
+  Table* t = table.load();
+  for (size_t i = 0; i < t->capacity(); ++i) {
+    Entry* entry = t->slots[i].load();
+    if (entry)
+      Entry::Destroy(entry);
+  }
+  Table::Destroy(t);
+  delete sketch;
+}
+
+// Triangular probing over groups, which visits every group once when
+// their number is a power of 2.
+ptrdiff_t Bucket::Find(const string& k, uint64_t hash, Entry** entry) const {
+  const Table* t = table.load(memory_order_acquire);
+  uint8_t tag = TagOf(hash);
+  size_t mask = t->num_groups - 1;
+  size_t group = GroupOf(hash) & mask;
+  for (size_t i = 1; i <= t->num_groups; ++i) {
+    const uint8_t* group_tags = t->tags + group * kGroupSize;
+    uint32_t matches = MatchTag(group_tags, tag);
+    while (matches) {
+      size_t slot = group * kGroupSize + __builtin_ctz(matches);
+      Entry* candidate = t->slots[slot].load(memory_order_acquire);
+      if (candidate && candidate->hash == hash && candidate->KeyEquals(k)) {
+        *entry = candidate;
+        return slot;
+      }
+      matches &= matches - 1;
+    }
+    if (MatchTag(group_tags, kEmpty))
+      return -1;  // Insert would have stopped here.
+    group = (group + i) & mask;
+  }
+  return -1;
+}
+
+void Bucket::PrefetchGroup(uint64_t hash) const {
+  const Table* t = table.load(memory_order_acquire);
+  size_t slot = (GroupOf(hash) & (t->num_groups - 1)) * kGroupSize;
+  __builtin_prefetch(t->tags + slot);
+  __builtin_prefetch(t->slots + slot);
+}
+
+void Bucket::PrefetchEntry(uint64_t hash) const {
+  const Table* t = table.load(memory_order_acquire);
+  size_t group = GroupOf(hash) & (t->num_groups - 1);
+  uint32_t matches = MatchTag(t->tags + group * kGroupSize, TagOf(hash));
+  if (matches) {
+    size_t slot = group * kGroupSize + __builtin_ctz(matches);
+    Entry* entry = t->slots[slot].load(memory_order_acquire);
+    if (entry)
+      __builtin_prefetch(entry);
+  }
+}
+
+void Bucket::Insert(uint64_t hash, Entry* entry) {
+  // Keep at least 1/8th of the slots empty, so misses stop early.
+  if ((size + deleted + 1) * 8 > table.load()->capacity() * 7)
+    Rehash();
+  Table* t = table.load(memory_order_relaxed);
+  InsertInto(t, hash, entry);
+  ++size;
+  if (entry->timer.expire_at)
+    wheel.Add(&entry->timer);
+}
+
+void Bucket::InsertInto(Table* t, uint64_t hash, Entry* entry) {
+  size_t mask = t->num_groups - 1;
+  size_t group = GroupOf(hash) & mask;
+  for (size_t i = 1; ; ++i) {
+    uint32_t free_slots = MatchFree(t->tags + group * kGroupSize);
+    if (free_slots) {
+      size_t slot = group * kGroupSize + __builtin_ctz(free_slots);
+      // Entry first, so a reader matching the tag finds it.
+      t->slots[slot].store(entry, memory_order_release);
+      t->tags[slot] = TagOf(hash);
+      return;
+    }
+    group = (group + i) & mask;
+  }
+}
+
+void Bucket::Replace(size_t slot, Entry* entry) {
+  Table* t = table.load(memory_order_relaxed);
+  Entry* old = t->slots[slot].load(memory_order_relaxed);
+  t->slots[slot].store(entry, memory_order_release);
+  // Written again, that's reason enough to keep it.
+  LeaveWindow(old);
+  wheel.Remove(&old->timer);
+  if (entry->timer.expire_at)
+    wheel.Add(&entry->timer);
+  retired.Retire(old);
+}
+
+void Bucket::Erase(size_t slot) {
+  Table* t = table.load(memory_order_relaxed);
+  Entry* entry = t->slots[slot].load(memory_order_relaxed);
+  // If the group still has an empty slot, no probe ever went past it, so
+  // the slot can go straight back to empty.
+  const uint8_t* group_tags = t->tags + (slot / kGroupSize) * kGroupSize;
+  if (MatchTag(group_tags, kEmpty)) {
+    t->tags[slot] = kEmpty;
+  } else {
+    t->tags[slot] = kDeleted;
+    ++deleted;
+  }
+  t->slots[slot].store(NULL, memory_order_release);
+  --size;
+  LeaveWindow(entry);
+  wheel.Remove(&entry->timer);
+  retired.Retire(entry);
+}
+
+bool Bucket::EraseEntry(Entry* entry, uint64_t hash) {
+  ptrdiff_t slot = SlotOf(entry, hash);
+  if (slot < 0)
+    return false;
+  Erase(slot);
+  return true;
+}
+
+ptrdiff_t Bucket::SlotOf(const Entry* entry, uint64_t hash) const {
+  const Table* t = table.load(memory_order_relaxed);
+  uint8_t tag = TagOf(hash);
+  size_t mask = t->num_groups - 1;
+  size_t group = GroupOf(hash) & mask;
+  for (size_t i = 1; i <= t->num_groups; ++i) {
+    const uint8_t* group_tags = t->tags + group * kGroupSize;
+    uint32_t matches = MatchTag(group_tags, tag);
+    while (matches) {
+      size_t slot = group * kGroupSize + __builtin_ctz(matches);
+      if (t->slots[slot].load(memory_order_relaxed) == entry)
+        return slot;
+      matches &= matches - 1;
+    }
+    if (MatchTag(group_tags, kEmpty))
+      return -1;
+    group = (group + i) & mask;
+  }
+  return -1;
+}
+
+void Bucket::EnterWindow(Entry* entry, uint64_t hash) {
+  entry->in_window = true;
+  window.push_back(make_pair(entry, hash));
+  window_bytes += entry->Used();
+  ++window_size;
+  // Entries which left the window some other way pile up as they wait
+  // their turn, clear them out once they outnumber the rest.
+  if (window.size() > 2 * window_size + 64) {
+    deque<pair<Entry*, uint64_t> > live;
+    for (int i = 0; i < window.size(); ++i) {
+      if (SlotOf(window[i].first, window[i].second) >= 0 &&
+          window[i].first->in_window)
+        live.push_back(window[i]);
+    }
+    window.swap(live);
+  }
+}
+
+void Bucket::LeaveWindow(Entry* entry) {
+  if (!entry->in_window)
+    return;
+  entry->in_window = false;
+  window_bytes -= entry->Used();
+  --window_size;
+}
+
+void Bucket::Rehash() {
+  Table* old = table.load(memory_order_relaxed);
+  size_t num_groups = old->num_groups;
+  if (size * 2 >= old->capacity())
+    num_groups *= 2;  // Otherwise it's mostly tombstones, keep the size.
+
+  // Entries move over as they are, readers still on the old table keep
+  // finding them there.
+  Table* t = Table::Create(num_groups);
+  for (size_t i = 0; i < old->capacity(); ++i) {
+    Entry* entry = old->slots[i].load(memory_order_relaxed);
+    if (!entry)
+      continue;
+    InsertInto(t, entry->hash, entry);
+  }
+  deleted = 0;
+  clock_hand = 0;
+  memory += t->Bytes() - old->Bytes();
+  table.store(t, memory_order_release);
+  retired.Retire(old);
+}
+
+namespace {
+
+CacheOptions WithCapacity(uint64_t capacity) {
+  CacheOptions options;
+  options.capacity = capacity;
+  return options;
+}
+
+}  // namespace
+
+Cache::Cache(uint64_t capacity) : Cache(WithCapacity(capacity)) {}
+
+Cache::Cache(const CacheOptions& options)
+    : max_ttl_(options.max_ttl),
+      compress_min_bytes_(options.compress_min_bytes), compressed_(0),
+      compressed_in_(0), compressed_out_(0),
+      start_(chrono::steady_clock::now()),
+      now_(1), reclaimed_(0), contested_(0), rejected_(0), stopping_(false) {
+  uint64_t capacity = options.capacity;
+  int num_buckets = options.num_buckets > 0 ?
+      min(options.num_buckets, kMaxBuckets) : DefaultBuckets();
+  // A bucket gets at least one slab page worth.
+  threshold_ = max(capacity / num_buckets,
+                   static_cast<uint64_t>(kSlabPageSize));
   decrease_by_ = max(static_cast<uint64_t>(threshold_ * 0.01),
                      static_cast<uint64_t>(100 << 10));  // ~1%
+  window_threshold_ = threshold_ * options.admission_window;
+
+  // Slab pages are hardly ever full of live chunks, the arenas get an
+  // eighth on top of the capacity for that.
+  int num_nodes = options.numa ? NumaNodes() : 1;
+  uint64_t slab_limit = (capacity + capacity / 8) / num_nodes;
+  for (int i = 0; i < num_nodes; ++i) {
+    slabs_.push_back(new SlabAllocator(slab_limit, options.huge_pages,
+                                       num_nodes > 1 ? i : -1));
+  }
 
-  for (int i = 0; i < kNumBuckets; ++i) {
-    buckets_.push_back(new Bucket);
+  size_t sketch_counters =
+      options.admission ? threshold_ / kBytesPerSketchCounter : 0;
+  for (int i = 0; i < num_buckets; ++i) {
+    buckets_.push_back(new Bucket(&epochs_, slabs_[i % num_nodes], Now(),
+                                  sketch_counters));
   }
+  expire_thread_ = thread(&Cache::ExpireLoop, this);
 }
 
 Cache::~Cache() {
-  for (int i = 0; i < kNumBuckets; ++i) {
+  {
+    lock_guard<mutex> l(expire_m_);
+    stopping_ = true;
+  }
+  expire_cv_.notify_one();
+  expire_thread_.join();
+  for (int i = 0; i < buckets_.size(); ++i) {
     delete buckets_[i];
   }
+  for (int i = 0; i < slabs_.size(); ++i) {
+    delete slabs_[i];
+  }
 }
 
-// This function should already have lock acquired.
-Data* Cache::FindOrInsertData(Bucket* bucket, const string& k) {
-  Map::iterator itr = bucket->key_to_litr.find(k);
-  if (itr != bucket->key_to_litr.end()) {
-    // Move to end.
-    bucket->access_list.splice(bucket->access_list.end(),
-                               bucket->access_list,
-                               itr->second);
-    Itr back = --bucket->access_list.end();
-    itr->second = back;  // Store new location in map.
-    return *back;
+void Cache::AddOrReplace(const string& k, const memcache_router::KeyValue& kv) {
+  uint64_t hash = HashKey(k);
+  Bucket* bucket = buckets_[BucketIndex(hash)];
+  Entry* entry = NewEntry(bucket, k, hash, kv);
+  BucketLock l(bucket);
+  AddLocked(bucket, k, hash, entry);
+}
+
+void Cache::MultiAddOrReplace(const vector<CacheBatchItem>& items) {
+  // Entries are all built before taking any lock. Sorted by bucket, so
+  // each bucket is locked once.
+  vector<pair<size_t, size_t> > order;  // Bucket, then item.
+  vector<pair<uint64_t, Entry*> > entries(items.size());
+  for (size_t i = 0; i < items.size(); ++i) {
+    const string& k = *items[i].key;
+    uint64_t hash = HashKey(k);
+    size_t index = BucketIndex(hash);
+    entries[i] = make_pair(hash, NewEntry(buckets_[index], k, hash,
+                                          *items[i].kv));
+    order.push_back(make_pair(index, i));
   }
+  sort(order.begin(), order.end());
 
-  Data* d = new Data;
-  bucket->access_list.push_back(d);
-  bucket->key_to_litr[k] = --bucket->access_list.end();
-  return d;
+  for (size_t i = 0; i < order.size(); ) {
+    Bucket* bucket = buckets_[order[i].first];
+    BucketLock l(bucket);
+    size_t end = i;
+    for (; end < order.size() && order[end].first == order[i].first; ++end) {
+      size_t item = order[end].second;
+      AddLocked(bucket, *items[item].key, entries[item].first,
+                entries[item].second);
+    }
+    i = end;
+  }
 }
 
-void Cache::AddOrReplace(const string& k, const memcache_router::KeyValue& kv) {
-  Bucket* bucket = buckets_[GetIndex(k)];
-  lock_guard<mutex> l(bucket->m);
+// Copies, and compression, happen outside the lock.
+Entry* Cache::NewEntry(Bucket* bucket, const string& k, uint64_t hash,
+                       const memcache_router::KeyValue& kv) {
+  string compressed;
+  bool compress = compress_min_bytes_ > 0 &&
+                  kv.val().size() >= compress_min_bytes_ &&
+                  Compress(kv.val(), &compressed);
+  if (bucket->sketch)
+    bucket->sketch->Increment(hash);
+  return Entry::Create(bucket->slabs, k, hash, kv,
+                       compress ? &compressed : NULL, ExpireAt(kv));
+}
 
-  if (bucket->memory > threshold_) {
+void Cache::AddLocked(Bucket* bucket, const string& k, uint64_t hash,
+                      Entry* entry) {
+  // With admission, new keys make room for themselves as they leave the
+  // window. This only catches replaced values growing.
+  uint64_t limit = threshold_;
+  if (bucket->sketch)
+    limit += decrease_by_;
+  if (bucket->memory > limit) {
     DeleteStaleData(bucket, decrease_by_);
   }
 
-  Data* data = FindOrInsertData(bucket, k);
-  bucket->memory -= data->Used();
-  data->key = k;
-  data->value = kv.val();
-  data->flags = kv.flags();
-  data->cas = kv.cas();
-  bucket->memory += data->Used();
+  Entry* old = NULL;
+  ptrdiff_t slot = bucket->Find(k, hash, &old);
+  if (slot >= 0) {
+    bucket->memory -= old->Used();
+    bucket->Replace(slot, entry);
+  } else {
+    bucket->Insert(hash, entry);
+    if (bucket->sketch)
+      bucket->EnterWindow(entry, hash);
+  }
+  bucket->memory += entry->Used();
+  if (bucket->sketch)
+    Admit(bucket);
 }
 
+// CLOCK: the hand clears the referenced bit of the entries it passes, and
+// evicts those which didn't get a hit since the last time around, or have
+// expired.
 // This function should already have lock acquired.
 void Cache::DeleteStaleData(Bucket* bucket, uint64_t decrease_by) {
   uint64_t target = bucket->memory - decrease_by;
-  Itr itr = bucket->access_list.begin();
-  while (itr != bucket->access_list.end()) {
-    Data* data = *itr;
-    itr = bucket->access_list.erase(itr);
-    bucket->key_to_litr.erase(data->key);
-    bucket->memory -= data->Used();
-    delete data;
-    if (bucket->memory < target)
+  while (bucket->memory >= target) {
+    ptrdiff_t slot = NextVictim(bucket);
+    if (slot < 0)
       break;
+    Table* t = bucket->table.load(memory_order_relaxed);
+    bucket->memory -= t->slots[slot].load(memory_order_relaxed)->Used();
+    bucket->Erase(slot);
+  }
+}
+
+ptrdiff_t Cache::NextVictim(Bucket* bucket) {
+  uint32_t now = Now();
+  Table* t = bucket->table.load(memory_order_relaxed);
+  size_t mask = t->capacity() - 1;
+  // Two sweeps clear every bit, so that's as far as the hand needs to go.
+  for (size_t n = 0; n < 2 * t->capacity(); ++n) {
+    size_t slot = bucket->clock_hand;
+    bucket->clock_hand = (slot + 1) & mask;
+    Entry* entry = t->slots[slot].load(memory_order_relaxed);
+    if (!entry || entry->in_window)
+      continue;
+    if (!entry->Expired(now) &&
+        entry->referenced.load(memory_order_relaxed)) {
+      entry->referenced.store(0, memory_order_relaxed);
+      continue;
+    }
+    return slot;
+  }
+  return -1;
+}
+
+// Only called with bucket->m held.
+void Cache::Admit(Bucket* bucket) {
+  uint32_t now = Now();
+  while (bucket->window_bytes > window_threshold_ && !bucket->window.empty()) {
+    Entry* candidate = bucket->window.front().first;
+    uint64_t hash = bucket->window.front().second;
+    bucket->window.pop_front();
+    // Checks the table holds it before looking at it, as it may be gone.
+    ptrdiff_t slot = bucket->SlotOf(candidate, hash);
+    if (slot < 0 || !candidate->in_window)
+      continue;
+    bucket->LeaveWindow(candidate);
+    if (bucket->memory <= threshold_)
+      continue;  // Room for it.
+
+    contested_.fetch_add(1, memory_order_relaxed);
+    int frequency = bucket->sketch->Frequency(hash);
+    while (bucket->memory > threshold_) {
+      ptrdiff_t victim_slot = NextVictim(bucket);
+      if (victim_slot < 0 || victim_slot == slot)
+        break;
+      Table* t = bucket->table.load(memory_order_relaxed);
+      Entry* victim = t->slots[victim_slot].load(memory_order_relaxed);
+      if (!victim->Expired(now) &&
+          frequency <= bucket->sketch->Frequency(victim->hash)) {
+        break;
+      }
+      bucket->memory -= victim->Used();
+      bucket->Erase(victim_slot);
+    }
+    if (bucket->memory > threshold_) {
+      // Lost, or nothing else to evict.
+      rejected_.fetch_add(1, memory_order_relaxed);
+      bucket->memory -= candidate->Used();
+      bucket->Erase(slot);
+    }
   }
 }
 
 bool Cache::Get(const string& k, memcache_router::KeyValue* kv) {
-  Bucket* bucket = buckets_[GetIndex(k)];
-  lock_guard<mutex> l(bucket->m);
-  Data* data = FindOrInsertData(bucket, k);
+  uint64_t hash = HashKey(k);
+  Counters* counters = &counters_[ThreadSlot::Id()];
+  EpochGuard guard(&epochs_);
+  return Lookup(buckets_[BucketIndex(hash)], k, hash, kv, NULL, counters);
+}
+
+void Cache::MultiGet(vector<CacheBatchItem>* items) {
+  // Hashes everything up front, so lookups can be prefetched ahead.
+  // Sorted by bucket, so a bucket's table stays in cache for all its keys.
+  vector<pair<size_t, pair<uint64_t, size_t> > > order;
+  for (size_t i = 0; i < items->size(); ++i) {
+    uint64_t hash = HashKey(*(*items)[i].key);
+    order.push_back(make_pair(BucketIndex(hash), make_pair(hash, i)));
+  }
+  sort(order.begin(), order.end());
 
-  if (data->value.empty()) {
-    ++miss_;
+  Counters* counters = &counters_[ThreadSlot::Id()];
+  EpochGuard guard(&epochs_);
+  for (size_t i = 0; i < order.size(); ++i) {
+    // Tags and slots of the key 2 strides ahead, then the entry its tag
+    // points to once they are in.
+    if (i + 2 * kPrefetchStride < order.size()) {
+      const pair<size_t, pair<uint64_t, size_t> >& ahead =
+          order[i + 2 * kPrefetchStride];
+      buckets_[ahead.first]->PrefetchGroup(ahead.second.first);
+    }
+    if (i + kPrefetchStride < order.size()) {
+      const pair<size_t, pair<uint64_t, size_t> >& ahead =
+          order[i + kPrefetchStride];
+      buckets_[ahead.first]->PrefetchEntry(ahead.second.first);
+    }
+    CacheBatchItem& item = (*items)[order[i].second.second];
+    item.hit = Lookup(buckets_[order[i].first], *item.key,
+                      order[i].second.first, item.kv,
+                      item.by_reference ? &item.value : NULL, counters);
+  }
+}
+
+bool Cache::Lookup(Bucket* bucket, const string& k, uint64_t hash,
+                   memcache_router::KeyValue* kv, Entry** value,
+                   Counters* counters) {
+  if (bucket->sketch)
+    bucket->sketch->Increment(hash);
+  Entry* entry = NULL;
+  if (bucket->Find(k, hash, &entry) < 0) {
+    Bump(&counters->misses);
+    return false;
+  }
+  if (entry->Expired(Now())) {
+    Bump(&counters->misses);
+    Bump(&counters->expired);
+    TryErase(bucket, entry, hash);
     return false;
   }
-  ++hits_;
-  kv->set_val(data->value);
-  kv->set_flags(data->flags);
-  kv->set_cas(data->cas);
+  Bump(&counters->hits);
+  entry->Touch();
+  if (entry->compressed) {
+    Decompress(entry, kv->mutable_val(), counters);
+  } else if (value) {
+    // Readable for as long as the guard holds, so it still has the
+    // table's reference to add to.
+    entry->Ref();
+    *value = entry;
+  } else {
+    kv->set_val(entry->value(), entry->value_size);
+  }
+  kv->set_flags(entry->flags);
+  kv->set_cas(entry->cas);
   return true;
 }
 
+bool Cache::Compress(const string& value, string* compressed) {
+  uLongf size = compressBound(value.size());
+  compressed->resize(sizeof(uint32_t) + size);
+  char* out = &(*compressed)[0];
+  uint32_t raw_size = value.size();
+  memcpy(out, &raw_size, sizeof(raw_size));
+  if (compress2(reinterpret_cast<Bytef*>(out + sizeof(raw_size)), &size,
+                reinterpret_cast<const Bytef*>(value.data()), value.size(),
+                Z_BEST_SPEED) != Z_OK) {
+    return false;
+  }
+  compressed->resize(sizeof(raw_size) + size);
+  if (compressed->size() > value.size() - value.size() / 8)
+    return false;  // Already compressed, most likely.
+
+  compressed_.fetch_add(1, memory_order_relaxed);
+  compressed_in_.fetch_add(value.size(), memory_order_relaxed);
+  compressed_out_.fetch_add(compressed->size(), memory_order_relaxed);
+  return true;
+}
+
+void Cache::Decompress(const Entry* entry, string* value,
+                       Counters* counters) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  uint32_t raw_size = 0;
+  memcpy(&raw_size, entry->value(), sizeof(raw_size));
+  value->resize(raw_size);
+  uLongf size = raw_size;
+  int rc = uncompress(
+      reinterpret_cast<Bytef*>(&(*value)[0]), &size,
+      reinterpret_cast<const Bytef*>(entry->value() + sizeof(raw_size)),
+      entry->value_size - sizeof(raw_size));
+  CHECK(rc == Z_OK && size == raw_size);
+  Bump(&counters->decompressed);
+  Bump(&counters->decompress_ns, chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now() - start).count());
+}
+
+uint32_t Cache::ExpireAt(const memcache_router::KeyValue& kv) const {
+  uint64_t ttl = kv.expire_in_seconds();
+  if (ttl > kMaxRelativeExpiry) {
+    uint64_t now = time(NULL);
+    if (ttl <= now)
+      return Now();  // Expired already.
+    ttl -= now;
+  }
+  return ExpireIn(ttl);
+}
+
+uint32_t Cache::ExpireIn(uint64_t ttl) const {
+  if (max_ttl_ > 0 && (ttl == 0 || ttl > max_ttl_))
+    ttl = max_ttl_;
+  if (ttl == 0)
+    return 0;
+  return min(static_cast<uint64_t>(Now()) + ttl,
+             static_cast<uint64_t>(UINT32_MAX));
+}
+
+bool Cache::SaveSnapshot(const string& path, uint64_t* entries) {
+  SnapshotWriter writer(path);
+  vector<Entry*> live;
+  for (size_t b = 0; b < buckets_.size() && writer.ok(); ++b) {
+    Bucket* bucket = buckets_[b];
+    uint32_t now = 0;
+    live.clear();
+    {
+      lock_guard<mutex> l(bucket->m);
+      now = Now();
+      Table* t = bucket->table.load(memory_order_relaxed);
+      for (size_t i = 0; i < t->capacity(); ++i) {
+        Entry* entry = t->slots[i].load(memory_order_relaxed);
+        if (entry && !entry->Expired(now)) {
+          entry->Ref();
+          live.push_back(entry);
+        }
+      }
+    }
+    // Expiries were set on the cache's clock, which doesn't survive us.
+    uint64_t unix_now = time(NULL);
+    for (size_t i = 0; i < live.size(); ++i) {
+      Entry* entry = live[i];
+      uint64_t expire_at = 0;
+      if (entry->timer.expire_at != 0)
+        expire_at = unix_now + (entry->timer.expire_at - now);
+      writer.Append(entry->key(), entry->key_size, entry->value(),
+                    entry->value_size, entry->flags, entry->cas, expire_at,
+                    entry->compressed);
+      Entry::Unref(entry);
+    }
+  }
+  *entries = writer.records();
+  return writer.Commit();
+}
+
+bool Cache::LoadSnapshot(const string& path, int threads, uint64_t* entries) {
+  SnapshotReader reader;
+  if (!reader.Open(path))
+    return false;
+  const vector<const SnapshotRecord*>& records = reader.records();
+  uint64_t unix_now = time(NULL);
+  atomic<uint64_t> loaded(0);
+  // Contiguous ranges, so each loader reads its part of the file in order.
+  size_t per_thread = (records.size() + max(threads, 1) - 1) / max(threads, 1);
+  vector<thread> loaders;
+  for (size_t first = 0; first < records.size(); first += per_thread) {
+    loaders.push_back(thread([&, first] {
+      size_t last = min(records.size(), first + per_thread);
+      uint64_t added = 0;
+      for (size_t i = first; i < last; ++i) {
+        if (AddRecord(*records[i], unix_now))
+          ++added;
+      }
+      loaded.fetch_add(added, memory_order_relaxed);
+    }));
+  }
+  for (int i = 0; i < loaders.size(); ++i) {
+    loaders[i].join();
+  }
+  *entries = loaded.load();
+  return true;
+}
+
+bool Cache::AddRecord(const SnapshotRecord& record, uint64_t unix_now) {
+  uint64_t ttl = 0;
+  if (record.expire_at != 0) {
+    if (record.expire_at <= unix_now)
+      return false;
+    ttl = record.expire_at - unix_now;
+  }
+  string k(record.key(), record.key_size);
+  uint64_t hash = HashKey(k);
+  Bucket* bucket = buckets_[BucketIndex(hash)];
+  if (bucket->sketch)
+    bucket->sketch->Increment(hash);
+  Entry* entry = Entry::Create(bucket->slabs, k, hash, record.value(),
+                               record.value_size, record.flags, record.cas,
+                               record.compressed != 0, ExpireIn(ttl));
+  BucketLock l(bucket);
+  AddLocked(bucket, k, hash, entry);
+  return true;
+}
+
+// Readers never wait on writers, so an expired entry is left for the wheel
+// if the bucket is busy.
+void Cache::TryErase(Bucket* bucket, Entry* entry, uint64_t hash) {
+  unique_lock<mutex> l(bucket->m, try_to_lock);
+  if (!l.owns_lock())
+    return;
+  // Still safe to read, the caller's epoch guard holds it. It may have been
+  // replaced or erased meanwhile, in which case it's no longer there.
+  uint64_t used = entry->Used();
+  if (bucket->EraseEntry(entry, hash))
+    bucket->memory -= used;
+}
+
+void Cache::ExpireLoop() {
+  vector<TimerLink*> expired;
+  while (true) {
+    {
+      unique_lock<mutex> l(expire_m_);
+      if (expire_cv_.wait_for(l, chrono::seconds(1),
+                              [this] { return stopping_; }))
+        return;
+    }
+    uint32_t now = 1 + chrono::duration_cast<chrono::seconds>(
+        chrono::steady_clock::now() - start_).count();
+    now_.store(now, memory_order_relaxed);
+
+    for (int i = 0; i < buckets_.size(); ++i) {
+      Bucket* bucket = buckets_[i];
+      BucketLock l(bucket);
+      expired.clear();
+      bucket->wheel.Advance(now, &expired);
+      for (int j = 0; j < expired.size(); ++j) {
+        Entry* entry = Entry::FromTimer(expired[j]);
+        bucket->memory -= entry->Used();
+        // Everything on the wheel is in the table.
+        CHECK(bucket->EraseEntry(entry, entry->hash));
+      }
+      reclaimed_.fetch_add(expired.size(), memory_order_relaxed);
+    }
+  }
+}
+
+void Cache::PopulateStats(memcache_router::Stats* stats) {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t expired = 0;
+  uint64_t decompressed = 0;
+  uint64_t decompress_ns = 0;
+  int num_threads = ThreadSlot::HighWater();
+  for (int i = 0; i < num_threads; ++i) {
+    hits += counters_[i].hits.load(memory_order_relaxed);
+    misses += counters_[i].misses.load(memory_order_relaxed);
+    expired += counters_[i].expired.load(memory_order_relaxed);
+    decompressed += counters_[i].decompressed.load(memory_order_relaxed);
+    decompress_ns += counters_[i].decompress_ns.load(memory_order_relaxed);
+  }
+  stats->mutable_cache_hit()->set_count(hits);
+  stats->mutable_cache_miss()->set_count(misses);
+  if (hits + misses > 0) {
+    memcache_router::Breakdown* ratio = stats->mutable_cache_hit_ratio();
+    ratio->set_average(static_cast<double>(hits) / (hits + misses));
+    ratio->set_count(hits + misses);
+  }
+  stats->mutable_cache_expired()->set_count(expired);
+  stats->mutable_cache_reclaimed()->set_count(
+      reclaimed_.load(memory_order_relaxed));
+  uint64_t compressed = compressed_.load(memory_order_relaxed);
+  if (compressed > 0) {
+    memcache_router::Breakdown* ratio = stats->mutable_cache_compression();
+    ratio->set_count(compressed);
+    ratio->set_average(
+        static_cast<double>(compressed_in_.load(memory_order_relaxed)) /
+        compressed_out_.load(memory_order_relaxed));
+  }
+  if (decompressed > 0) {
+    memcache_router::Breakdown* latency =
+        stats->mutable_cache_decompress_latency();
+    latency->set_count(decompressed);
+    latency->set_average(decompress_ns / 1000.0 / decompressed);
+  }
+  uint64_t contested = contested_.load(memory_order_relaxed);
+  if (contested > 0) {
+    uint64_t rejected = rejected_.load(memory_order_relaxed);
+    memcache_router::Breakdown* admission =
+        stats->mutable_cache_admission_rejected();
+    admission->set_count(rejected);
+    admission->set_average(static_cast<double>(rejected) / contested);
+  }
+  uint64_t acquisitions = 0;
+  uint64_t contended = 0;
+  uint64_t hold_ns = 0;
+  for (int i = 0; i < buckets_.size(); ++i) {
+    Bucket* bucket = buckets_[i];
+    memcache_router::CacheBucketStats* s = stats->add_cache_buckets();
+    lock_guard<mutex> l(bucket->m);
+    s->set_entries(bucket->size);
+    s->set_bytes(bucket->memory);
+    s->set_lock_acquisitions(bucket->lock_acquisitions);
+    s->set_lock_contended(bucket->lock_contended);
+    if (bucket->lock_acquisitions > 0) {
+      s->set_lock_hold_us(
+          bucket->lock_hold_ns / 1000.0 / bucket->lock_acquisitions);
+    }
+    acquisitions += bucket->lock_acquisitions;
+    contended += bucket->lock_contended;
+    hold_ns += bucket->lock_hold_ns;
+  }
+  if (acquisitions > 0) {
+    memcache_router::Breakdown* hold = stats->mutable_cache_lock_hold();
+    hold->set_count(acquisitions);
+    hold->set_average(hold_ns / 1000.0 / acquisitions);
+    memcache_router::Breakdown* waits = stats->mutable_cache_lock_contended();
+    waits->set_count(contended);
+    waits->set_average(static_cast<double>(contended) / acquisitions);
+  }
+  // Summed up over the nodes.
+  for (int i = 0; i < slabs_.size(); ++i) {
+    slabs_[i]->PopulateStats(stats);
+  }
+}
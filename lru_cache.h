@@ -2,7 +2,63 @@
 #define MEMCACHE_ROUTER_CACHE_H
 
 /*
- * This is a thread safe LRU cache designed for multi-threaded access.
+ * This is a thread safe cache designed for multi-threaded access.
+ *
+ * Keys are spread over buckets, each an open addressing table whose writers
+ * are serialized by its own mutex. Tags (7 bits of the key's hash) sit in
+ * their own array, so a probe compares 16 of them at once with SSE2 and
+ * only touches entries whose tag matched. Every entry is a single
+ * allocation holding its key and value inline, and is never modified once
+ * published. Eviction is CLOCK, so a hit only sets a bit.
+ *
+ * There are 4 buckets per core by default, as that's how many writers may
+ * contend for them. A key's 64-bit hash is worked out once, and kept in its
+ * entry; separate bits of it pick the bucket, the group to probe first and
+ * the tag. On NUMA boxes, buckets take turns over the nodes, and carve
+ * their entries out of slabs on their own node.
+ *
+ * Values past a configurable size can be kept compressed with zlib, at its
+ * fastest level, if that saves at least an eighth of them. They are
+ * compressed before the bucket is locked, and only inflated by the Gets
+ * which hit them.
+ *
+ * The cache can be saved to a snapshot file and loaded back from it (see
+ * snapshot.h), so a restart doesn't start out cold. Saving references a
+ * bucket's entries under its lock, and writes them out after.
+ *
+ * Entries are carved out of slabs (see slab.h), and are accounted for with
+ * the full size of their chunk. Along with the tables, that is what the
+ * capacity is held against.
+ *
+ * Get takes no lock at all. Writers publish entries with release stores,
+ * and retire replaced or evicted entries (and outgrown tables) through
+ * epoch based reclamation, so readers never see freed memory. A reader may
+ * see a value which is being replaced at that moment, which is as good as
+ * having read just before the replace.
+ *
+ * MultiGet can also hand values out by reference, for callers which send
+ * them on without a copy. Entries are reference counted, the table holding
+ * one reference, so a replaced or evicted entry stays around until the
+ * last value handed out of it is dropped. Those entries no longer count
+ * against the capacity, and must all be dropped before the cache goes.
+ *
+ * Entries expire like memcached's items do, after the expire_in_seconds
+ * they were set with, and no later than the cache's max TTL, if it has one.
+ * Values read from memcached don't come with their expiry, so the max TTL
+ * is all that bounds them. A Get treats an expired entry as a miss, and
+ * erases it if the bucket's lock is free. Each bucket also keeps its
+ * expiring entries on a timer wheel (see timer_wheel.h), which a background
+ * thread advances every second, so expired entries give their memory back
+ * even if nobody asks for them again.
+ *
+ * Admission is optional, and follows W-TinyLFU. Each bucket counts how
+ * often keys are read or written in a frequency sketch (see
+ * frequency_sketch.h). New keys go into a small window, about 1% of the
+ * bucket, in the order they came in. A key which ages out of the window
+ * joins the rest of the bucket if there's room. Otherwise it has to be
+ * asked for more often than the entry CLOCK would evict in its place, or
+ * it is the one to go. So keys seen once, from scans and batch jobs, pass
+ * through the window without flushing out the hot set.
  *
  * NOTE: The following benchmarks were run on DEV box, which is a
  * SINGLE virtual core.
@@ -82,81 +138,428 @@
  * 1M GETs done in usecs: 1801276 Avg us: 1.80128
  * 1M GETs done in usecs: 1790689 Avg us: 1.79069
  * 25165824 done in seconds: 5 at throughput of 5033164 per sec
+ *
+ * ==============
+ *
+ * UPDATE, open addressing with CLOCK, on a single core box.
+ * With 50 bytes key, and 1024 bytes value (8 threads, 64 buckets):
+ * Before, list + unordered_map:
+ * Memory per item: 1393 bytes, for 1076 bytes of key and value
+ * 1M GETs done in usecs: 2723725 Avg us: 2.72372
+ * 1M GETs done in usecs: 2685344 Avg us: 2.68534
+ * 25165824 done in seconds: 8.62997 at throughput of 2916096 per sec
+ * After:
+ * Memory per item: 1166 bytes, for 1076 bytes of key and value
+ * 1M GETs done in usecs: 1899872 Avg us: 1.89987
+ * 1M GETs done in usecs: 1953370 Avg us: 1.95337
+ * 25165824 done in seconds: 6.25077 at throughput of 4026035 per sec
+ *
+ * UPDATE, Get without locks (epoch based reclamation), same box and set up:
+ * Memory per item: 1139 bytes, for 1076 bytes of key and value
+ * 1M GETs done in usecs: 1798371 Avg us: 1.79837
+ * 1M GETs done in usecs: 1802664 Avg us: 1.80266
+ * 25165824 done in seconds: 5.46915 at throughput of 4601414 per sec
+ *
+ * UPDATE, entries in slabs, same box and set up. Items now take a whole
+ * chunk of their size class, which costs a little more per item, but is
+ * what the capacity gets held against:
+ * Memory per item: 1204 bytes, for 1076 bytes of key and value
+ * 1M GETs done in usecs: 1817916 Avg us: 1.81792
+ * 1M GETs done in usecs: 1830174 Avg us: 1.83017
+ * 25165824 done in seconds: 5.84375 at throughput of 4306454 per sec
+ *
+ * UPDATE, admission, from HitRatioTest in the same benchmark: Zipf (0.9)
+ * reads over 1M keys, a third of all requests scanning keys read once,
+ * 64MB cache, single thread:
+ * CLOCK: Zipf hit ratio 0.486948, rejected 0, in seconds: 7.62471
+ * W-TinyLFU: Zipf hit ratio 0.544285, rejected 2522897, in seconds: 8.32675
+ *
+ * UPDATE, MurmurHash64A kept in the entry, bucket count from the cores (16
+ * on this single core box), same set up otherwise. Most of the gain is the
+ * hash, and probes comparing it before the key:
+ * Memory per item: 1191 bytes, for 1076 bytes of key and value
+ * 25165824 done in seconds: 3.87548 at throughput of 6493608 per sec
+ *
+ * UPDATE, compression, from CompressionTest in the same benchmark: 2KB
+ * values made of pickle like text. zlib inflates at ~170MB/s on this box,
+ * so a hit on a compressed value costs ~15us more:
+ * Compress from 0 bytes: memory per item: 2193 bytes, for 2108 bytes of
+ * key and value, ratio 0, decompress us 0
+ * Compress from 1024 bytes: memory per item: 1186 bytes, for 2108 bytes of
+ * key and value, ratio 2.13396, decompress us 17.3785
+ *
+ * UPDATE, MultiGet, from BatchTest in the same benchmark: random keys out
+ * of 200K 1KB items, in batches of 1000:
+ * Get batches of 1000: avg us per batch 1542.83
+ * MultiGet batches of 1000: avg us per batch 880.125
  */
 
 #include <atomic>
-#include <functional>
-#include <list>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <mutex>
 #include <string>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 
+#include "epoch.h"
+#include "frequency_sketch.h"
 #include "memdata.pb.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "timer_wheel.h"
 using namespace std;
 
-const int kNumBuckets = 64;
-struct Data {
-  string key;
-  string value;
-  uint32_t flags;
-  uint64_t cas;
+const int kMinBuckets = 16;
+const int kMaxBuckets = 1024;
 
+// Tags are probed a group at a time.
+const int kGroupSize = 16;
+// A full slot's tag is 7 bits of its key's hash, so the high bit alone
+// tells free slots apart.
+const uint8_t kEmpty = 0x80;
+const uint8_t kDeleted = 0xFE;  // Tombstone, probing goes on past it.
+
+// A cached item in one allocation: this header, then the key, then the
+// value. Immutable once published, apart from the CLOCK bit, and the
+// timer links, which only writers touch.
+struct Entry {
+  // expire_at is in seconds of the cache's clock, 0 for never. If
+  // compressed isn't NULL, it's kept instead of kv's value.
+  static Entry* Create(SlabAllocator* slabs, const string& k, uint64_t hash,
+                       const memcache_router::KeyValue& kv,
+                       const string* compressed, uint32_t expire_at);
+  static Entry* Create(SlabAllocator* slabs, const string& k, uint64_t hash,
+                       const char* value, uint32_t value_size, uint32_t flags,
+                       uint64_t cas, bool compressed, uint32_t expire_at);
+  // Drops the table's reference, once no reader can see the entry anymore.
+  static void Destroy(Entry* entry);
+
+  // Values handed out by reference hold on to their entry, so it outlives
+  // its slot until the last reference is dropped.
+  void Ref() {
+    refs.fetch_add(1, memory_order_relaxed);
+  }
+  static void Unref(Entry* entry);
+
+  static Entry* FromTimer(TimerLink* link) {
+    return reinterpret_cast<Entry*>(
+        reinterpret_cast<char*>(link) - offsetof(Entry, timer));
+  }
+
+  const char* key() const {
+    return reinterpret_cast<const char*>(this + 1);
+  }
+
+  const char* value() const {
+    return key() + key_size;
+  }
+
+  bool KeyEquals(const string& k) const;
+
+  bool Expired(uint32_t now) const {
+    return timer.expire_at != 0 && timer.expire_at <= now;
+  }
+
+  // Bytes really taken up, including what the slab chunk wastes.
   int Used() const {
-    return key.size() + value.size() + sizeof(uint32_t) + sizeof(uint64_t);
+    return SlabAllocator::ChunkSize(this, slab_class);
+  }
+
+  // Readers only ever set the bit, and only if it isn't set already, so a
+  // hot entry's cache line isn't written on every hit.
+  void Touch() {
+    if (!referenced.load(memory_order_relaxed))
+      referenced.store(1, memory_order_relaxed);
+  }
+
+  TimerLink timer;  // On the bucket's wheel, if it expires.
+  uint64_t hash;  // Of the key.
+  uint64_t cas;
+  uint32_t flags;
+  uint32_t key_size;
+  uint32_t value_size;
+  atomic<uint32_t> refs;  // The table's, and the handed out values'.
+  atomic<uint8_t> referenced;  // CLOCK bit.
+  uint8_t slab_class;
+  bool in_window;  // Not admitted yet.
+  // The value is the size it inflates to, as a uint32_t, then the zlib
+  // stream.
+  bool compressed;
+};
+
+// A bucket's slots. Replaced as a whole when the bucket grows, so readers
+// always see matching arrays.
+// Tags are written under the bucket mutex and read without it. A reader
+// which sees a stale tag either misses, or finds the slot's entry doesn't
+// match its key, as it checks the entry itself before using it.
+struct Table {
+  static Table* Create(size_t num_groups);
+  static void Destroy(Table* table);
+
+  size_t capacity() const {
+    return num_groups * kGroupSize;
+  }
+
+  uint64_t Bytes() const {
+    return sizeof(Table) + capacity() * (sizeof(uint8_t) + sizeof(Entry*));
   }
 
+  size_t num_groups;  // Power of 2.
+  uint8_t* tags;
+  atomic<Entry*>* slots;  // NULL once erased.
 };
-typedef list<Data*> List;
-typedef List::iterator Itr;
-typedef unordered_map<string, Itr> Map;
 
 struct Bucket {
-  Bucket() : memory(0) {}
-  ~Bucket() {
-    for (Itr itr = access_list.begin(); itr != access_list.end(); ++itr) {
-      delete *itr;
+  // Entries come out of slabs. No admission if sketch_counters is 0.
+  Bucket(EpochManager* epochs, SlabAllocator* slabs, uint32_t now,
+         size_t sketch_counters);
+  ~Bucket();
+
+  // Returns the slot holding k, and sets *entry, or returns -1 if there's
+  // none. Safe without m, from inside an EpochGuard.
+  ptrdiff_t Find(const string& k, uint64_t hash, Entry** entry) const;
+  // Pull in what Find(hash) reads first: the tags and slots of the first
+  // group, then the entry of the first matching tag. Also without m.
+  void PrefetchGroup(uint64_t hash) const;
+  void PrefetchEntry(uint64_t hash) const;
+
+  // NOTE: These should be called with m acquired.
+  // k must not be in the table already.
+  void Insert(uint64_t hash, Entry* entry);
+  // Swaps in entry, and retires the one it replaces.
+  void Replace(size_t slot, Entry* entry);
+  // Frees up the slot, and retires its entry.
+  void Erase(size_t slot);
+  // Erases the entry, if the table still holds it.
+  bool EraseEntry(Entry* entry, uint64_t hash);
+  // Returns the slot holding entry, or -1. Only compares pointers, so
+  // entry needn't be alive.
+  ptrdiff_t SlotOf(const Entry* entry, uint64_t hash) const;
+  // entry must be in the table.
+  void EnterWindow(Entry* entry, uint64_t hash);
+  void LeaveWindow(Entry* entry);
+
+  mutable mutex m;
+  SlabAllocator* slabs;  // Shared with other buckets on the NUMA node.
+  atomic<Table*> table;
+  size_t size;  // Full slots.
+  size_t deleted;  // Tombstones.
+  size_t clock_hand;
+  // Total memory used by bucket, entries and table.
+  uint64_t memory;
+  RetireList retired;
+  TimerWheel wheel;  // Entries which expire.
+
+  // Admission. All of it is unused if sketch is NULL.
+  FrequencySketch* sketch;  // Read and written without m.
+  // Oldest first. Holds entries erased or replaced since, which get
+  // skipped.
+  deque<pair<Entry*, uint64_t> > window;
+  uint64_t window_bytes;
+  size_t window_size;  // Entries really in the window.
+
+  // Taking m through BucketLock.
+  uint64_t lock_acquisitions;
+  uint64_t lock_contended;  // Had to wait.
+  uint64_t lock_hold_ns;
+
+ private:
+  static void InsertInto(Table* table, uint64_t hash, Entry* entry);
+  // Rebuilds the table, doubled if it's at least half full.
+  void Rehash();
+};
+
+// Holds a bucket's mutex, and counts how long for, and whether it had to
+// wait for it.
+class BucketLock {
+ public:
+  explicit BucketLock(Bucket* bucket) : bucket_(bucket) {
+    if (!bucket_->m.try_lock()) {
+      bucket_->m.lock();
+      ++bucket_->lock_contended;
     }
+    start_ = chrono::steady_clock::now();
   }
 
-  mutable mutex m;
-  Map key_to_litr; // Map stores (key, List Iterator) pairs. 
+  ~BucketLock() {
+    ++bucket_->lock_acquisitions;
+    bucket_->lock_hold_ns += chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - start_).count();
+    bucket_->m.unlock();
+  }
 
-  // Every time Data is accessed, its moved to the back of list.
-  // Hence, the front of this list always has stale entries.
-  List access_list;
-  // Total memory used by bucket.
-  uint64_t memory;
+ private:
+  Bucket* bucket_;
+  chrono::steady_clock::time_point start_;
+};
+
+struct CacheOptions {
+  CacheOptions() : capacity(0), huge_pages(false), max_ttl(0),
+                   admission(false), admission_window(0.01), num_buckets(0),
+                   numa(true), compress_min_bytes(0) {}
+
+  uint64_t capacity;  // Bytes.
+  // Back the slab arenas with huge pages. Reserved ones if there are any,
+  // transparent ones otherwise.
+  bool huge_pages;
+  // Seconds an entry may live at most, whatever it was set with. Zero for
+  // no limit.
+  uint32_t max_ttl;
+  // W-TinyLFU admission of new keys, with a window of this share of the
+  // capacity.
+  bool admission;
+  double admission_window;
+  // Zero for 4 per core, within [kMinBuckets, kMaxBuckets].
+  int num_buckets;
+  // Spread buckets and their memory over the NUMA nodes, if there are
+  // several.
+  bool numa;
+  // Keep values at least this big compressed. Zero for never.
+  uint32_t compress_min_bytes;
+};
+
+// A key of a batch. hit is set by MultiGet.
+// With by_reference set, MultiGet hands a hit's value out as a reference on
+// its entry, in value, and leaves kv's value alone. The value stays put
+// until the caller drops it with Entry::Unref, even if the entry gets
+// replaced or evicted meanwhile. Compressed values are inflated into kv
+// all the same.
+struct CacheBatchItem {
+  CacheBatchItem()
+      : key(NULL), kv(NULL), hit(false), by_reference(false), value(NULL) {}
+  CacheBatchItem(const string* key, memcache_router::KeyValue* kv)
+      : key(key), kv(kv), hit(false), by_reference(false), value(NULL) {}
+
+  const string* key;
+  memcache_router::KeyValue* kv;
+  bool hit;
+  bool by_reference;
+  Entry* value;
 };
 
 class Cache {
  public:
   explicit Cache(uint64_t capacity);
+  explicit Cache(const CacheOptions& options);
   ~Cache();
 
   void AddOrReplace(const string& k, const memcache_router::KeyValue& kv);
+  // Locks each bucket once for the whole batch.
+  void MultiAddOrReplace(const vector<CacheBatchItem>& items);
+  // Never takes a lock, and never changes the table.
   bool Get(const string& k, memcache_router::KeyValue* kv);
-  void PopulateStats(memcache_router::Stats* stats) {
-    stats->mutable_cache_hit()->set_count(hits_);
-    stats->mutable_cache_miss()->set_count(miss_);
-  }
+  // Looks up the batch bucket by bucket, prefetching keys ahead, and fills
+  // in the KeyValues of the hits.
+  void MultiGet(vector<CacheBatchItem>* items);
+  void PopulateStats(memcache_router::Stats* stats);
+
+  // Writes the live entries out to a snapshot at path (see snapshot.h).
+  // A bucket is only locked while its entries get referenced, not while
+  // they're written. Returns false if the snapshot couldn't be written.
+  bool SaveSnapshot(const string& path, uint64_t* entries);
+  // Adds the entries of the snapshot at path which haven't expired yet,
+  // split over that many threads. Values go in as they were saved,
+  // compressed or not. Returns false if there's no usable snapshot.
+  bool LoadSnapshot(const string& path, int threads, uint64_t* entries);
 
  private:
-  int GetIndex(const string& k) {
-    size_t h = str_hash(k);
-    return h % kNumBuckets;
+  // Bits 25 to 56 of the hash pick the bucket, without a division. Within
+  // a bucket, the low bits pick the group and the top 7 bits are the tag,
+  // so none of the three depend on each other.
+  size_t BucketIndex(uint64_t hash) const {
+    return (((hash >> 25) & 0xFFFFFFFF) * buckets_.size()) >> 32;
   }
-  
-  Data* FindOrInsertData(Bucket* bucket, const string& k);
+
+  // Keys MultiGet looks ahead by, per stage of prefetching.
+  static const int kPrefetchStride = 4;
+
+  Entry* NewEntry(Bucket* bucket, const string& k, uint64_t hash,
+                  const memcache_router::KeyValue& kv);
+  // NOTE: Should be called with bucket->m acquired.
+  void AddLocked(Bucket* bucket, const string& k, uint64_t hash,
+                 Entry* entry);
   void DeleteStaleData(Bucket* bucket, uint64_t decrease_by);
+  // Moves the CLOCK hand on to the next entry to evict, and returns its
+  // slot. Entries in the window are left alone. -1 if there's none.
+  ptrdiff_t NextVictim(Bucket* bucket);
+  // Lets the oldest keys out of the window, until it's back under its
+  // share. Each is admitted if it's more popular than what it would evict.
+  void Admit(Bucket* bucket);
+
+  // Seconds since the cache was created, as of the last tick.
+  uint32_t Now() const {
+    return now_.load(memory_order_relaxed);
+  }
+
+  // When an entry set with kv expires, 0 for never.
+  uint32_t ExpireAt(const memcache_router::KeyValue& kv) const;
+  // When an entry with ttl seconds left expires, 0 ttl for never.
+  uint32_t ExpireIn(uint64_t ttl) const;
+  // Adds a snapshot record, unless it expired by unix_now.
+  bool AddRecord(const SnapshotRecord& record, uint64_t unix_now);
+  // Erases entry, unless a writer holds the bucket.
+  void TryErase(Bucket* bucket, Entry* entry, uint64_t hash);
+  // Ticks the clock and the buckets' wheels, once a second.
+  void ExpireLoop();
+
+  // Hits and misses are counted per thread, so readers share no writes.
+  // Only ever written by the thread owning the slot.
+  struct Counters {
+    Counters() : hits(0), misses(0), expired(0), decompressed(0),
+                 decompress_ns(0) {}
+
+    atomic<uint64_t> hits;
+    atomic<uint64_t> misses;
+    atomic<uint64_t> expired;  // Also counted as misses.
+    atomic<uint64_t> decompressed;
+    atomic<uint64_t> decompress_ns;
+    char pad[kCacheLineSize - 5 * sizeof(atomic<uint64_t>)];
+  };
+
+  static void Bump(atomic<uint64_t>* counter, uint64_t by = 1) {
+    counter->store(counter->load(memory_order_relaxed) + by,
+                   memory_order_relaxed);
+  }
+
+  // Get, from inside an EpochGuard. If value isn't NULL, an uncompressed
+  // hit is handed out through it by reference.
+  bool Lookup(Bucket* bucket, const string& k, uint64_t hash,
+              memcache_router::KeyValue* kv, Entry** value,
+              Counters* counters);
+
+  // Returns false if value isn't worth compressing.
+  bool Compress(const string& value, string* compressed);
+  void Decompress(const Entry* entry, string* value, Counters* counters);
 
-  atomic_ullong hits_;
-  atomic_ullong miss_;
-  hash<string> str_hash;
+  EpochManager epochs_;
+  vector<SlabAllocator*> slabs_;  // One per NUMA node.
+  Counters counters_[kMaxEpochThreads];
   uint64_t decrease_by_;
   uint64_t threshold_;
+  uint64_t window_threshold_;
+  const uint32_t max_ttl_;
+  const uint32_t compress_min_bytes_;
+  // Values compressed, and their bytes before and after.
+  atomic<uint64_t> compressed_;
+  atomic<uint64_t> compressed_in_;
+  atomic<uint64_t> compressed_out_;
+  const chrono::steady_clock::time_point start_;
+  atomic<uint32_t> now_;
+  atomic<uint64_t> reclaimed_;  // By the wheels.
+  // Keys let out of a full window, and those of them evicted for being
+  // less popular than the entry they were up against.
+  atomic<uint64_t> contested_;
+  atomic<uint64_t> rejected_;
   vector<Bucket*> buckets_;
+
+  mutex expire_m_;
+  condition_variable expire_cv_;
+  bool stopping_;  // GUARDED_BY expire_m_
+  thread expire_thread_;
 };
 
 #endif
-
@@ -1,32 +1,156 @@
 #include <atomic>
+#include <cerrno>
 #include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #include <deque>
+#include <functional>
 #include <iostream>
 #include <libmemcached/memcached.h>
+#include <memory>
 #include <mutex>
 #include <random>
+#include <signal.h>
 #include <string>
+#include <sys/eventfd.h>
+#include <unordered_map>
+#include <unistd.h>
 #include <vector>
 #include <zmq.h>
 
+#include "binary_engine.h"
 #include "lru_cache.h"
 #include "memclient.h"
 #include "memdata.pb.h"
+#include "mpmc_queue.h"
 #include "utils.h"
 using namespace std;
 
+using router_utils::AtomicStats;
+using router_utils::LatencyHistogram;
 using router_utils::Timer;
 using router_utils::Stats;
 using router_utils::ThreadSafeStats;
 #define MAX_KEYS_PER_REQUEST 10000
 
+// Smaller cached values are copied into the reply, as a frame costs more
+// than the copy.
+const int kMinValueFrameBytes = 4096;
+
+// Frees a value frame's data, as zmq_free_fn. The data is the value of the
+// entry given as hint.
+void ReleaseValueFrame(void* /* data */, void* hint) {
+  Entry::Unref(static_cast<Entry*>(hint));
+}
+
 struct Packet {
+  Packet()
+      : data_bytes(0), frontend(0), parent(NULL),
+        first_key(0), parts_left(0), num_values(0) {
+    zmq_msg_init(&reply);
+  }
+
+  ~Packet() {
+    CloseFrames();
+    ReleaseValues();
+    zmq_msg_close(&reply);
+  }
+
+  // Gets the packet ready for reuse. Clearing the instruction keeps its
+  // KeyValues and their strings around, which the next parse fills in
+  // place of allocating new ones.
+  void Reset() {
+    CloseFrames();
+    ReleaseValues();
+    zmq_msg_close(&reply);
+    zmq_msg_init(&reply);
+    instruction.Clear();
+    data_bytes = 0;
+    parent = NULL;
+  }
+
+  // Takes over the message. Routing frames are kept as zmq messages, so
+  // client identities are never copied out.
+  void AddFrame(zmq_msg_t* msg) {
+    frames.push_back(zmq_msg_t());
+    zmq_msg_init(&frames.back());
+    zmq_msg_move(&frames.back(), msg);
+  }
+
+  // Serializes the instruction into reply, so whoever sends it only has to
+  // hand the message over to zmq.
+  void SerializeReply() {
+    num_values = 0;
+    for (int i = 0; i < values.size(); ++i) {
+      if (values[i])
+        instruction.mutable_get_keys(i)->set_val_frame(++num_values);
+    }
+    zmq_msg_close(&reply);
+    router_utils::SerializeToMessage(instruction, &reply);
+  }
+
+  void CloseFrames() {
+    for (int i = 0; i < frames.size(); ++i) {
+      zmq_msg_close(&frames[i]);
+    }
+    frames.clear();
+  }
+
+  // Drops the values which weren't handed over to zmq.
+  void ReleaseValues() {
+    for (int i = 0; i < values.size(); ++i) {
+      if (values[i])
+        Entry::Unref(values[i]);
+    }
+    values.clear();
+    num_values = 0;
+  }
+
+  // KeyValues left over by Clear in each field, which parsing reuses
+  // before allocating. A field only reuses its own.
+  struct Spares {
+    int get_keys;
+    int set_keys;
+    int incr_keys;
+  };
+
+  Spares SpareKeyValues() const {
+    Spares spares = {instruction.get_keys().ClearedCount(),
+                     instruction.set_keys().ClearedCount(),
+                     instruction.incr_keys().ClearedCount()};
+    return spares;
+  }
+
+  // KeyValues the instruction had to allocate, with spares from before it
+  // was parsed.
+  int NewKeyValues(const Spares& spares) const {
+    return max(0, instruction.get_keys_size() - spares.get_keys) +
+           max(0, instruction.set_keys_size() - spares.set_keys) +
+           max(0, instruction.incr_keys_size() - spares.incr_keys);
+  }
+
   Timer timer;
-  vector<string> frame_ids;
+  // Usually just the client's identity, but there is one more per proxy on
+  // the way. A deque never moves them, which zmq messages don't allow.
+  deque<zmq_msg_t> frames;
+  int data_bytes;  // Size of the instruction, as received.
   memcache_router::Instruction instruction;
+  zmq_msg_t reply;  // Set by SerializeReply.
+  int frontend;  // Which frontend the packet came in through.
+
+  // Set on the parts of a split GET. Each part fetches the parent's keys
+  // starting at first_key, and the last part to finish sends the parent.
+  Packet* parent;
+  int first_key;
+  atomic_int parts_left;  // On the parent.
+
+  // Cached values which go out as frames of their own, after the reply,
+  // indexed like the GET keys and NULL for the rest. Each holds a
+  // reference on its entry. Only used if the client asked for
+  // value_frames, and sized up front by PushSplit on a split parent.
+  vector<Entry*> values;
+  int num_values;  // Set by SerializeReply.
 
   enum Type {
     UNKNOWN,
@@ -57,160 +181,669 @@ struct Packet {
     return instruction.get_keys_size() > 0;
   }
 
+  int NumKeys() const {
+    return instruction.get_keys_size() + instruction.set_keys_size() +
+           instruction.incr_keys_size();
+  }
+
   void Print() {
-    for (int i = 0; i < frame_ids.size(); ++i) {
-      cout << "client id: " << frame_ids[i] << endl;
+    for (int i = 0; i < frames.size(); ++i) {
+      cout << "client id: "
+           << string(static_cast<char*>(zmq_msg_data(&frames[i])),
+                     zmq_msg_size(&frames[i])) << endl;
     }
     cout << "packet data: " << instruction.DebugString() << endl;
   }
+
+ private:
+  // Packets hold on to zmq messages, and get recycled through PacketPool.
+  Packet(const Packet&);
+  void operator=(const Packet&);
+};
+
+// Packets which served more than this many bytes aren't worth keeping, as
+// the strings inside hold on to all of that capacity.
+const int kMaxPooledPacketBytes = 64 << 10;
+const int kPacketPoolSize = 4096;
+
+// Recycles packets between the router loop, which receives into them, and
+// the workers, which are done with them once they've replied.
+class PacketPool {
+ public:
+  PacketPool() : free_(kPacketPoolSize) {}
+
+  ~PacketPool() {
+    Packet* p = NULL;
+    while (free_.TryPop(&p)) {
+      delete p;
+    }
+  }
+
+  // Sets *reused to false, if a packet had to be allocated.
+  Packet* Get(bool* reused) {
+    Packet* p = NULL;
+    *reused = free_.TryPop(&p);
+    if (!*reused)
+      p = new Packet;
+    return p;
+  }
+
+  void Release(Packet* p) {
+    // Cached size is set by the reply's serialization, free to read.
+    if (p->data_bytes > kMaxPooledPacketBytes ||
+        p->instruction.GetCachedSize() > kMaxPooledPacketBytes ||
+        p->NumKeys() > MAX_KEYS_PER_REQUEST / 10) {
+      delete p;
+      return;
+    }
+    p->Reset();
+    if (!free_.TryPush(p))
+      delete p;
+  }
+
+ private:
+  MPMCQueue<Packet*> free_;
+};
+
+// Number of packets which can be queued up in a lane, before the router
+// loop has to wait for the workers to catch up.
+const int kQueueCapacity = 1 << 16;
+
+// Max replies sent per drain, so incoming requests get polled in between.
+const int kMaxRepliesPerDrain = 256;
+
+// Replies on their way back to the router loop, which owns the ROUTER
+// socket. Workers serialize a reply before pushing it, so the loop has
+// nothing left to do but hand frames over to zmq.
+// The loop polls fd() along with its sockets. It's only written to when
+// the queue goes from empty to non-empty, so a busy queue costs no
+// syscalls on the worker side.
+class ReplyQueue {
+ public:
+  ReplyQueue() : replies_(kQueueCapacity), pending_(0) {
+    fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    CHECK(fd_ != -1);
+  }
+
+  ~ReplyQueue() {
+    Packet* p = NULL;
+    while (replies_.TryPop(&p)) {
+      delete p;
+    }
+    close(fd_);
+  }
+
+  int fd() const {
+    return fd_;
+  }
+
+  void Push(Packet* p) {
+    // Counted before the push, so the loop never sees the queue as done
+    // while a reply is still on its way in.
+    bool wake = pending_.fetch_add(1) == 0;
+    while (!replies_.TryPush(p)) {
+      this_thread::yield();  // Loop is behind.
+    }
+    if (wake)
+      Signal();
+  }
+
+  // Called by the loop once fd() polls readable. If there are more replies
+  // than one drain takes, fd() is left readable for the next poll.
+  void Drain(vector<Packet*>* packets) {
+    uint64_t count;
+    while (read(fd_, &count, sizeof(count)) == -1 && errno == EINTR) {}
+
+    Packet* p = NULL;
+    while (packets->size() < kMaxRepliesPerDrain && replies_.TryPop(&p)) {
+      packets->push_back(p);
+    }
+    int popped = packets->size();
+    if (pending_.fetch_sub(popped) != popped) {
+      if (popped == 0)
+        this_thread::yield();  // A Push is half way through.
+      Signal();
+    }
+  }
+
+ private:
+  void Signal() {
+    uint64_t one = 1;
+    ssize_t rc;
+    do {
+      rc = write(fd_, &one, sizeof(one));
+    } while (rc == -1 && errno == EINTR);
+    CHECK(rc == sizeof(one));
+  }
+
+  MPMCQueue<Packet*> replies_;
+  atomic_int pending_;  // Pushed, or about to be, and not drained yet.
+  int fd_;
+};
+
+// Frontend i listens on these ports plus 2 * i.
+const int kRouterPort = 5555;
+const int kAsyncPort = 5556;
+
+// One receive loop, with its own sockets. All frontends feed the same
+// queue and workers, and replies find their way back through the
+// frontend's own ReplyQueue.
+struct Frontend {
+  Frontend(void* context, int i) : index(i) {
+    router = zmq_socket(context, ZMQ_ROUTER);
+    int rc = zmq_bind(router, Endpoint(kRouterPort + 2 * i).c_str());
+    CHECK(rc == 0);
+
+    async = zmq_socket(context, ZMQ_PULL);
+    rc = zmq_bind(async, Endpoint(kAsyncPort + 2 * i).c_str());
+    CHECK(rc == 0);
+  }
+
+  ~Frontend() {
+    zmq_close(router);
+    zmq_close(async);
+  }
+
+  static string Endpoint(int port) {
+    return "tcp://*:" + to_string(port);
+  }
+
+  const int index;
+  void* router;
+  void* async;
+  ReplyQueue replies;
+};
+
+// Work is queued up in a separate lane per operation class. So writes never
+// sit in front of latency sensitive reads, and each class gets batched
+// only with its own kind.
+enum Lane {
+  GET_LANE = 0,
+  SET_LANE,
+  INCR_LANE,
+  NUM_LANES,
+};
+
+struct LanePolicy {
+  LanePolicy() : weight(1), max_keys(1) {}
+  LanePolicy(int w, int k) : weight(w), max_keys(k) {}
+
+  int weight;  // Share of pops which look at this lane first.
+  int max_keys;  // Stop adding packets to a batch past this many keys.
+};
+
+struct QueueOptions {
+  QueueOptions()
+      : lanes(NUM_LANES), batch_window_us(0), batch_target_keys(256),
+        batch_deep_queue(32), split_get_keys(1000), p99_target_us(0) {
+    lanes[GET_LANE] = LanePolicy(8, MAX_KEYS_PER_REQUEST);
+    lanes[SET_LANE] = LanePolicy(1, 1000);
+    lanes[INCR_LANE] = LanePolicy(1, 100);
+  }
+
+  vector<LanePolicy> lanes;  // Indexed by Lane.
+
+  // Adaptive GET batching. A worker which pops fewer than batch_target_keys
+  // keys may wait up to the current window for more GETs to show up.
+  // Zero window turns it off.
+  int batch_window_us;
+  int batch_target_keys;
+  // Lane depth (in packets) at which waiting stops paying off, because
+  // batches fill up on their own. The window shrinks linearly towards it.
+  int batch_deep_queue;
+  // GET packets with more keys than this get split into parts of this
+  // size, which workers fetch in parallel. Zero turns it off.
+  int split_get_keys;
+  // If set, the window is halved whenever GET p99 goes over this, and
+  // slowly grown back while it stays under. Zero turns it off.
+  int p99_target_us;
+};
+
+// How workers talk to memcached.
+struct BackendOptions {
+  BackendOptions() : binary(false), connections_per_server(2) {}
+
+  // BinaryEngine, shared by all workers, instead of a libmemcached client
+  // each.
+  bool binary;
+  int connections_per_server;
 };
 
+// How often the batching window gets re-evaluated against GET p99.
+const int kAdjustWindowEveryUs = 100000;
+
 class PCQueue {
   public:
-    PCQueue() : done_(false) {}
+    explicit PCQueue(const QueueOptions& options)
+        : done_(false), options_(options), ticket_(0),
+          window_us_(options.batch_window_us), last_p99_us_(0),
+          last_adjust_us_(router_utils::NowMicros()) {
+      for (int i = 0; i < NUM_LANES; ++i) {
+        lanes_.push_back(new MPMCQueue<Packet*>(kQueueCapacity));
+      }
+      BuildSchedule();
+    }
+
+    ~PCQueue() {
+      for (int i = 0; i < NUM_LANES; ++i) {
+        delete lanes_[i];
+      }
+    }
 
     void UnblockAll() {
       done_ = true;
-      cond_.notify_all();
+      waiters_.NotifyAll();
+      get_arrivals_.NotifyAll();
     }
 
     void Reset() {
       done_ = false;
     }
 
+    // Pops a batch of packets, all from the same lane. Once unblocked, it
+    // still hands out what's queued, and only comes back empty when there
+    // is nothing left. A popped packet always goes to the caller.
     void BlockingPop(vector<Packet*>* packets) {
-      unique_lock<mutex> ul(m_);
-      // The following line doesn't compile even with c++0x flag.
-      // cond_.wait(ul, [this]{return !packets_.empty();});
-      // The next expression should be equivalent.
-      while (!done_ && packets_.empty()) {
-        cond_.wait(ul);  // release lock, block.
-        // When notified, this would wake up, and reacquire lock
-        // before returning.
+      while (true) {
+        if (TryPopBatch(packets) || done_)
+          return;
+
+        uint32_t epoch = waiters_.PrepareWait();
+        // Recheck, a Push could have landed before PrepareWait.
+        if (TryPopBatch(packets) || done_) {
+          waiters_.CancelWait();
+          return;
+        }
+        waiters_.Wait(epoch);  // Parks on futex until the next Push.
       }
-      if (done_)
-        return;
+    }
 
+    void Push(Packet* p) {
+      // Used to take around 13 us, when this was a mutex guarded deque.
       Timer t;
-      int num_get_keys = 0;
-      while (!packets_.empty() && num_get_keys < MAX_KEYS_PER_REQUEST) {
-        Packet* p = packets_.front();
-
-        if (!p->IsGet()) {
-          // All such operations should be run singly because
-          // libmemcached doesn't allow batching them up.
-          if (num_get_keys == 0) {
-            packets_.pop_front();
-            packets->push_back(p);
-          }
-          // else don't include this packet.
-          break;
-        } else {
-          packets_.pop_front();
-          packets->push_back(p);
-          num_get_keys += p->instruction.get_keys_size();
+      Lane lane = LaneFor(p);
+      while (!lanes_[lane]->TryPush(p)) {
+        // Lane is full, workers are behind. Let them catch up.
+        this_thread::yield();
+      }
+      waiters_.NotifyOne();
+      if (lane == GET_LANE)
+        get_arrivals_.NotifyOne();
+      push_stats_.Increment(t.GetDelay());
+    }
+
+    // Called with the end to end latency of every GET packet. Feeds the
+    // p99 reported in stats, and the batching window controller.
+    void RecordGetLatency(int usecs) {
+      get_latency_.Increment(usecs);
+      int64_t now = router_utils::NowMicros();
+      int64_t last = last_adjust_us_.load(memory_order_relaxed);
+      if (now - last < kAdjustWindowEveryUs)
+        return;
+      if (!last_adjust_us_.compare_exchange_strong(last, now))
+        return;  // Some other worker got to it.
+      AdjustWindow();
+    }
+
+    void PopulateStats(Packet* p) {
+      memcache_router::Stats* stats = p->instruction.mutable_stats();
+      push_stats_.Set(stats->mutable_push_latency());
+      pop_stats_.Set(stats->mutable_pop_latency());
+      batch_wait_stats_.Set(stats->mutable_batch_wait());
+      stats->mutable_batch_window()->set_average(window_us_);
+      stats->mutable_batch_window()->set_count(1);
+      stats->mutable_get_latency_p99()->set_average(last_p99_us_);
+      stats->mutable_get_latency_p99()->set_count(1);
+    }
+
+  private:
+    static Lane LaneFor(const Packet* p) {
+      switch (p->GetType()) {
+        case Packet::GET:
+          return GET_LANE;
+        case Packet::SET:
+          return SET_LANE;
+        case Packet::INCREMENT:
+          return INCR_LANE;
+        default:
+          CHECK(false);
+      }
+    }
+
+    // Spreads each lane's weight evenly over one round of the schedule,
+    // so with weights 8:1:1 a SET batch comes up once every 10 pops,
+    // instead of 8 GET batches in a row followed by everything else.
+    void BuildSchedule() {
+      int total = 0;
+      for (int i = 0; i < NUM_LANES; ++i) {
+        total += options_.lanes[i].weight;
+      }
+      vector<int> credit(NUM_LANES, 0);
+      for (int n = 0; n < total; ++n) {
+        int best = GET_LANE;
+        for (int i = 0; i < NUM_LANES; ++i) {
+          credit[i] += options_.lanes[i].weight;
+          if (credit[i] > credit[best])
+            best = i;
         }
+        credit[best] -= total;
+        schedule_.push_back(static_cast<Lane>(best));
       }
+      if (schedule_.empty())
+        schedule_.push_back(GET_LANE);
+    }
 
-      // If we didn't process all the packets, notify another thread.
-      if (packets_.size() > 0) {
-        cond_.notify_one();
+    // Tries the lane picked by the schedule first. If that's empty, GETs
+    // get priority, followed by the other lanes in order.
+    bool TryPopBatch(vector<Packet*>* packets) {
+      Timer t;
+      uint32_t ticket = ticket_.fetch_add(1, memory_order_relaxed);
+      Lane lane = schedule_[ticket % schedule_.size()];
+      int depth = lanes_[lane]->ApproxSize();
+      int num_keys = PopFromLane(lane, 0, packets);
+      for (int i = 0; i < NUM_LANES && packets->empty(); ++i) {
+        lane = static_cast<Lane>(i);
+        depth = lanes_[lane]->ApproxSize();
+        num_keys = PopFromLane(lane, 0, packets);
       }
+      if (packets->empty())
+        return false;
       pop_stats_.Increment(t.GetDelay());
+
+      if (lane == GET_LANE)
+        WaitForMoreGets(depth, num_keys, packets);
+      return true;
     }
 
-    void Push(Packet* p) {
-      // Push is taking around 13 us.
+    // Returns the number of keys in the batch after popping.
+    int PopFromLane(Lane lane, int num_keys, vector<Packet*>* packets) {
+      Packet* p = NULL;
+      while (num_keys < options_.lanes[lane].max_keys &&
+             lanes_[lane]->TryPop(&p)) {
+        packets->push_back(p);
+        num_keys += p->NumKeys();
+        if (p->parent) {
+          // Parts of a split packet are meant for separate workers, so one
+          // ends the batch.
+          return max(num_keys, options_.lanes[lane].max_keys);
+        }
+      }
+      return num_keys;
+    }
+
+    // Adaptive micro batching. Holds on to a small GET batch for up to the
+    // current window, so more keys can share the same mget round trip.
+    // depth is the lane depth seen before the batch was popped; a deep lane
+    // means batches are filling up on their own, so the wait shrinks.
+    void WaitForMoreGets(int depth, int num_keys, vector<Packet*>* packets) {
+      int window = window_us_.load(memory_order_relaxed);
+      if (window <= 0 || num_keys >= options_.batch_target_keys)
+        return;
+      if (depth >= options_.batch_deep_queue)
+        return;
+      window -= window * depth / options_.batch_deep_queue;
+
       Timer t;
-      lock_guard<mutex> lk(m_);
-      packets_.push_back(p);
-      cond_.notify_one();
-      push_stats_.Increment(t.GetDelay());
+      int target = min(options_.batch_target_keys,
+                       options_.lanes[GET_LANE].max_keys);
+      while (num_keys < target && !done_) {
+        size_t before = packets->size();
+        num_keys = PopFromLane(GET_LANE, num_keys, packets);
+        if (packets->size() > before)
+          continue;
+
+        int left = window - t.GetDelay();
+        if (left <= 0)
+          break;
+        uint32_t epoch = get_arrivals_.PrepareWait();
+        if (lanes_[GET_LANE]->ApproxSize() > 0) {
+          get_arrivals_.CancelWait();
+          continue;
+        }
+        get_arrivals_.WaitFor(epoch, left);
+      }
+      batch_wait_stats_.Increment(t.GetDelay());
     }
 
-    void PopulateStats(Packet* p) {
-      lock_guard<mutex> lk(m_);
-      p->instruction.mutable_stats()->mutable_push_latency()->set_average(
-          push_stats_.Average());
-      p->instruction.mutable_stats()->mutable_push_latency()->set_count(
-          push_stats_.counter);
-      p->instruction.mutable_stats()->mutable_pop_latency()->set_average(
-          pop_stats_.Average());
-      p->instruction.mutable_stats()->mutable_pop_latency()->set_count(
-          pop_stats_.counter);
+    // AIMD on the batching window: halve it as soon as p99 overshoots the
+    // target, grow it back a tenth of the max at a time while under.
+    void AdjustWindow() {
+      int p99 = get_latency_.Percentile(0.99);
+      get_latency_.Reset();
+      last_p99_us_ = p99;
+      if (options_.p99_target_us <= 0 || options_.batch_window_us <= 0)
+        return;
+
+      int window = window_us_.load(memory_order_relaxed);
+      if (p99 > options_.p99_target_us) {
+        window /= 2;
+      } else {
+        window = min(options_.batch_window_us,
+                     window + max(1, options_.batch_window_us / 10));
+      }
+      window_us_.store(window, memory_order_relaxed);
     }
 
-  private:
-    Stats pop_stats_;
-    Stats push_stats_;  // GUARDED_BY m_
+    AtomicStats batch_wait_stats_;
+    AtomicStats pop_stats_;
+    AtomicStats push_stats_;
     atomic_bool done_;
-    condition_variable cond_;
-    deque<Packet*> packets_;  // GUARDED_BY m_
-    mutable mutex m_;
+    const QueueOptions options_;
+    vector<Lane> schedule_;
+    atomic<uint32_t> ticket_;
+    EventCount waiters_;
+    EventCount get_arrivals_;  // Only woken up by GET pushes.
+    vector<MPMCQueue<Packet*>*> lanes_;
+
+    LatencyHistogram get_latency_;
+    atomic_int window_us_;
+    atomic_int last_p99_us_;
+    atomic<int64_t> last_adjust_us_;
+};
+
+// A key of a worker's GET batch. Cache hits come with a reference on their
+// entry in value, and no value in kv.
+struct FetchedKey {
+  FetchedKey() : value(NULL) {}
+
+  memcache_router::KeyValue kv;
+  Entry* value;
+  // Where it goes, as (GET packet of the batch, key in the packet) pairs.
+  vector<pair<int, int> > waiting;
+};
+
+// A GET of one key, which other workers can join instead of fetching the
+// key themselves.
+struct Flight {
+  Flight(const string& k, int s) : key(k), shard(s), done(false), refs(1) {}
+
+  const string key;
+  const int shard;
+  // The rest is guarded by the shard mutex.
+  bool done;
+  int refs;  // Owner plus joiners. Last one out deletes the flight.
+  memcache_router::KeyValue result;
+};
+
+const int kInFlightShards = 64;
+
+// Router wide table of the keys workers are fetching from memcached right
+// now, so concurrent GETs of a hot key cost one round trip.
+// Owners must Complete all their flights before Waiting on any other,
+// which keeps two workers from ever waiting on each other.
+class InFlightTable {
+ public:
+  // Returns true if the caller is the first one after key, and so has to
+  // fetch it and Complete *flight. Otherwise the caller has to Wait on it.
+  bool Join(const string& key, Flight** flight) {
+    int shard = hash<string>()(key) % kInFlightShards;
+    Shard& s = shards_[shard];
+    lock_guard<mutex> lk(s.m);
+    auto itr = s.flights.find(key);
+    if (itr != s.flights.end()) {
+      *flight = itr->second;
+      ++(*flight)->refs;
+      return false;
+    }
+    *flight = new Flight(key, shard);
+    s.flights.insert(make_pair(key, *flight));
+    return true;
+  }
+
+  // Hands the result over to the joiners, and takes the key out of the
+  // table. Later GETs start a new flight.
+  void Complete(Flight* flight, const memcache_router::KeyValue& result) {
+    Shard& s = shards_[flight->shard];
+    lock_guard<mutex> lk(s.m);
+    flight->result = result;
+    flight->done = true;
+    s.flights.erase(flight->key);
+    if (flight->refs > 1)
+      s.cond.notify_all();
+    Release(flight);
+  }
+
+  void Wait(Flight* flight, memcache_router::KeyValue* result) {
+    Shard& s = shards_[flight->shard];
+    unique_lock<mutex> ul(s.m);
+    while (!flight->done) {
+      s.cond.wait(ul);
+    }
+    *result = flight->result;
+    Release(flight);
+  }
+
+ private:
+  // NOTE: This function should already have the shard mutex acquired.
+  void Release(Flight* flight) {
+    if (--flight->refs == 0)
+      delete flight;
+  }
+
+  struct Shard {
+    mutex m;
+    condition_variable cond;
+    unordered_map<string, Flight*> flights;
+  };
+
+  Shard shards_[kInFlightShards];
+};
+
+// A server list, as published to the workers. Never modified once
+// published; a new list gets a new config, and each worker moves over to
+// it in between batches. Old configs go away with their last worker.
+struct ServerConfig {
+  ServerConfig(const memcache_router::Instruction& instruction, int v)
+      : version(v), next_client(0),
+        server_keys(new AtomicStats[instruction.servers_size()]),
+        server_latency(new AtomicStats[instruction.servers_size()]) {
+    servers.mutable_servers()->CopyFrom(instruction.servers());
+  }
+
+  ~ServerConfig() {
+    for (int i = 0; i < warm_clients.size(); ++i) {
+      delete warm_clients[i];  // Unclaimed ones, if any.
+    }
+  }
+
+  // Hands out one of the clients connected ahead of the swap.
+  // Returns NULL once they have all been claimed.
+  MemClient* ClaimClient() {
+    int i = next_client.fetch_add(1);
+    if (i >= warm_clients.size())
+      return NULL;
+    MemClient* client = warm_clients[i];
+    warm_clients[i] = NULL;
+    return client;
+  }
+
+  memcache_router::Instruction servers;
+  const int version;
+  shared_ptr<BinaryEngine> engine;  // Only with the binary backend.
+  vector<MemClient*> warm_clients;
+  atomic_int next_client;
+  // GET keys sent to each server per batch, and how long it took to answer
+  // them. Indexed like servers.
+  unique_ptr<AtomicStats[]> server_keys;
+  unique_ptr<AtomicStats[]> server_latency;
 };
 
 class MemcacheRouter {
  public:
-  explicit MemcacheRouter(uint64_t cache_size, int num_threads)
-      : cache_(NULL), done_(false),
-        num_threads_(num_threads), server_list_(NULL) {
-    cout << "Cache set to " << cache_size << endl;
+  MemcacheRouter(const CacheOptions& cache_options, int num_threads,
+                 int num_frontends, const QueueOptions& queue_options,
+                 const BackendOptions& backend_options)
+      : cache_(NULL), get_queue_(queue_options),
+        backend_options_(backend_options),
+        split_get_keys_(queue_options.split_get_keys), done_(false),
+        num_threads_(num_threads), snapshot_loaded_(0), snapshot_load_ms_(0),
+        requested_version_(0), config_version_(0) {
+    cout << "Cache set to " << cache_options.capacity << endl;
     cout << "Threads set to " << num_threads << endl;
-    if (cache_size > 0) {
-      cache_ = new Cache(cache_size);
+    cout << "Frontends set to " << num_frontends << endl;
+    if (cache_options.capacity > 0) {
+      cache_ = new Cache(cache_options);
     }
     context_ = zmq_ctx_new();
-    router_ = zmq_socket(context_, ZMQ_ROUTER);
-    int rc = zmq_bind(router_, "tcp://*:5555");
-    CHECK(rc == 0);
-
-    async_ = zmq_socket(context_, ZMQ_PULL);
-    rc = zmq_bind(async_, "tcp://*:5556");
-    CHECK(rc == 0);
-
-    worker_output_ = zmq_socket(context_, ZMQ_PULL);
-    rc = zmq_bind(worker_output_, "inproc://workers");
-    CHECK(rc == 0);
+    for (int i = 0; i < num_frontends; ++i) {
+      frontends_.push_back(new Frontend(context_, i));
+    }
   }
 
   ~MemcacheRouter() {
-    zmq_close(router_);
-    zmq_close(async_);
-    zmq_close(worker_output_);
+    for (int i = 0; i < frontends_.size(); ++i) {
+      delete frontends_[i];
+    }
     zmq_ctx_destroy(context_);
   }
 
-  void Loop() {
+  // Runs the first frontend on the calling thread, and the rest on their
+  // own threads.
+  void Run() {
+    for (int i = 1; i < frontends_.size(); ++i) {
+      frontend_pool_.threads.push_back(
+          thread(&MemcacheRouter::Loop, this, frontends_[i]));
+    }
+    Loop(frontends_[0]);
+    frontend_pool_.Reset();
+  }
+
+  void Loop(Frontend* frontend) {
+    void* router = frontend->router;
+    vector<Packet*> replies;
     while (true) {
       zmq_pollitem_t items [] = {
-        { router_, 0, ZMQ_POLLIN, 0 },
-        { async_, 0, ZMQ_POLLIN, 0 },
-        { worker_output_, 0, ZMQ_POLLIN, 0 }
+        { router, 0, ZMQ_POLLIN, 0 },
+        { frontend->async, 0, ZMQ_POLLIN, 0 },
+        { NULL, frontend->replies.fd(), ZMQ_POLLIN, 0 }
       };
 
       zmq_poll(items, 3, -1);
       // Poll for inter-process communication (through clients).
       if (items[0].revents & ZMQ_POLLIN) {
-        Packet* p = ReceiveOnePacket(router_);
+        Packet* p = ReceiveOnePacket(frontend, router);
 
         // The following statement is useful for benchmarking purposes.
-        // SendAndDeletePacket(router_, p);
+        // SendAndReleasePacket(router, p);
 
         Packet::Type packet_type = p->GetType();
         if (packet_type == Packet::SERVER_LIST) {
           // Until an instruction arrives for setting hosts,
           // the router wouldn't process any requests.
           SetMemcacheServers(p);
-          SendEmptyPacket(router_, p);
-          delete p;
+          SendEmptyPacket(router, p);
+          packet_pool_.Release(p);
 
         } else if (packet_type == Packet::SET) {
-          SendEmptyPacket(router_, p);
+          SendEmptyPacket(router, p);
           get_queue_.Push(p);
 
         } else if (packet_type == Packet::STATS) {
           PopulateStats(p);
-          SendAndDeletePacket(router_, p);
+          SendAndReleasePacket(router, p);
+        } else if (packet_type == Packet::GET &&
+                   split_get_keys_ > 0 && p->NumKeys() > split_get_keys_) {
+          PushSplit(p);
         } else {
           // For GET and INCR, we need to wait before replying.
           get_queue_.Push(p);
@@ -219,42 +852,60 @@ class MemcacheRouter {
 
       // For SETs, client doesn't have to wait. So we use PULL socket.
       if (items[1].revents & ZMQ_POLLIN) {
-        Packet* p = ReceiveOnePacket(async_, false);
+        Packet* p = ReceiveOnePacket(frontend, frontend->async, false);
         CHECK(p->GetType() == Packet::SET);
         get_queue_.Push(p);
       }
 
-      // Poll for intra-process communication (through workers).
+      // Replies from the workers, already serialized.
       if (items[2].revents & ZMQ_POLLIN) {
-        int more = 1;
-        while (more) {
-          zmq_msg_t message;
-          zmq_msg_init(&message);
-          zmq_msg_recv(&message, worker_output_, 0);
-
-          more = zmq_msg_more(&message) ? ZMQ_SNDMORE : 0;
-          zmq_msg_send(&message, router_, more);
-          zmq_msg_close(&message);
+        replies.clear();
+        frontend->replies.Drain(&replies);
+        for (int i = 0; i < replies.size(); ++i) {
+          SendReply(router, replies[i]);
         }
       }
     }
   }
 
-  void BlockingWait() {
-    done_ = true;
-    get_queue_.UnblockAll();
-    thread_pool_.Reset();
+  // Warms the cache up from a snapshot, with a loader per core. Meant to be
+  // called before Run, so no request sees a half loaded cache.
+  void LoadSnapshot(const string& path) {
+    if (!cache_)
+      return;
+    Timer t;
+    uint64_t entries = 0;
+    if (!cache_->LoadSnapshot(path, thread::hardware_concurrency(), &entries))
+      return;
+    snapshot_loaded_ = entries;
+    snapshot_load_ms_ = t.GetDelay() / 1000.0;
+    cout << "Loaded " << entries << " cache entries from " << path << " in "
+         << snapshot_load_ms_ << " ms" << endl;
   }
 
-  void ProcessPackets() {
-    MemClient client(cache_);
+  // Saves the cache every interval_s seconds (never, if zero), and once
+  // more on SIGTERM or SIGINT before exiting. Those must be blocked in all
+  // threads, so they are only ever taken by the snapshot thread.
+  void StartSnapshots(const string& path, int interval_s) {
+    if (!cache_)
+      return;
+    snapshot_pool_.threads.push_back(
+        thread(&MemcacheRouter::SnapshotLoop, this, path, interval_s));
+  }
+
+  void BlockingWait() {
     {
       lock_guard<mutex> lk(server_list_m_);
-      client.Init(server_list_->instruction);
+      done_ = true;
+      server_list_cond_.notify_all();
     }
+    get_queue_.UnblockAll();
+    thread_pool_.Reset();
+  }
 
-    void* worker = zmq_socket(context_, ZMQ_PUSH);
-    zmq_connect(worker, "inproc://workers");
+  void ProcessPackets() {
+    shared_ptr<ServerConfig> config = atomic_load(&config_);
+    MemClient* client = ClientFor(config.get());
 
     Stats loop_latency;
     Stats batch_stats;
@@ -262,49 +913,113 @@ class MemcacheRouter {
     int counter = 0;
     random_device rd;
 
-    while (!done_) {
+    while (true) {
       vector<Packet*> packets;
       get_queue_.BlockingPop(&packets);
+      if (packets.empty())
+        break;  // Stopped, and nothing is left to serve.
       batch_stats.Increment(packets.size());
 
+      if (config_version_.load(memory_order_acquire) != config->version) {
+        // Server list got swapped. Move over before touching this batch.
+        config = atomic_load(&config_);
+        MemClient* fresh = ClientFor(config.get());
+        delete client;
+        client = fresh;
+      }
+
       Timer t;
-      map<string, memcache_router::KeyValue> key_to_kvalp;
+      map<string, FetchedKey> key_to_kvalp;
       vector<Packet*> get_packets;
+      vector<int> keys_left;  // Of each GET packet, still being fetched.
+      vector<Packet*> set_packets;
+      vector<memcache_router::KeyValue*> set_kvs;
+      vector<Packet*> incr_packets;
+      vector<memcache_router::KeyValue*> incr_kvs;
       for (int i = 0; i < packets.size(); ++i) {
         Packet* p = packets[i];
         Packet::Type t = p->GetType();
         if (t == Packet::SET) {
-          client.SetKeys(&p->instruction);
-          packet_stats.Increment(p->timer.GetDelay());
-          delete p;  // No need to send.
+          // Stored together, so each server gets one write for the batch.
+          for (int j = 0; j < p->instruction.set_keys_size(); ++j) {
+            set_kvs.push_back(p->instruction.mutable_set_keys(j));
+          }
+          set_packets.push_back(p);
 
         } else if (t == Packet::INCREMENT) {
-          client.IncrKeys(&p->instruction);
-          packet_stats.Increment(p->timer.GetDelay());
-          SendAndDeletePacket(worker, p);
+          // Sent together once the batch has been gone through.
+          for (int j = 0; j < p->instruction.incr_keys_size(); ++j) {
+            incr_kvs.push_back(p->instruction.mutable_incr_keys(j));
+          }
+          incr_packets.push_back(p);
 
         } else if (t == Packet::GET) {
           for (int j = 0; j < p->instruction.get_keys_size(); ++j) {
             const memcache_router::KeyValue& kv = p->instruction.get_keys(j);
-            key_to_kvalp.insert(make_pair(
-                kv.key(), memcache_router::KeyValue()));
+            key_to_kvalp[kv.key()].waiting.push_back(
+                make_pair(get_packets.size(), j));
           }
           get_packets.push_back(p);
+          keys_left.push_back(p->instruction.get_keys_size());
         }
       }
 
-      if (get_packets.size() > 0) {
-        client.GetKeys(&key_to_kvalp);
-        for (int i = 0; i < get_packets.size(); ++i) {
-          Packet* p = get_packets[i];
-          for (int j = 0; j < p->instruction.get_keys_size(); ++j) {
-            memcache_router::KeyValue* kv = p->instruction.mutable_get_keys(j);
-            auto itr = key_to_kvalp.find(kv->key());
-            CHECK(itr != key_to_kvalp.end());
-            kv->MergeFrom(itr->second);
+      if (set_packets.size() > 0) {
+        client->SetKeys(set_kvs);
+        for (int i = 0; i < set_packets.size(); ++i) {
+          packet_stats.Increment(set_packets[i]->timer.GetDelay());
+          packet_pool_.Release(set_packets[i]);  // No need to send.
+        }
+      }
+
+      if (incr_packets.size() > 0 && config->engine) {
+        // The engine pipelines them, so the batch costs one round trip.
+        Timer incr_timer;
+        client->IncrKeys(incr_kvs);
+        incr_latency_.Increment(incr_timer.GetDelay());
+        incr_batch_size_.Increment(incr_kvs.size());
+        for (int i = 0; i < incr_packets.size(); ++i) {
+          packet_stats.Increment(incr_packets[i]->timer.GetDelay());
+          Reply(incr_packets[i]);
+        }
+      } else {
+        // libmemcached takes a round trip per counter, so each packet is
+        // replied to as soon as its own are done.
+        for (int i = 0; i < incr_packets.size(); ++i) {
+          Packet* p = incr_packets[i];
+          vector<memcache_router::KeyValue*> kvs;
+          for (int j = 0; j < p->instruction.incr_keys_size(); ++j) {
+            kvs.push_back(p->instruction.mutable_incr_keys(j));
           }
+          Timer incr_timer;
+          client->IncrKeys(kvs);
+          incr_latency_.Increment(incr_timer.GetDelay());
+          incr_batch_size_.Increment(kvs.size());
           packet_stats.Increment(p->timer.GetDelay());
-          SendAndDeletePacket(worker, p);
+          Reply(p);
+        }
+      }
+
+      if (get_packets.size() > 0) {
+        // Packets go out as soon as their last key is in, so the ones
+        // which don't need a slow server don't wait for it.
+        FetchKeys(client, config.get(), &key_to_kvalp,
+                  [&](FetchedKey* fetched) {
+          for (int i = 0; i < fetched->waiting.size(); ++i) {
+            int index = fetched->waiting[i].first;
+            int j = fetched->waiting[i].second;
+            Packet* p = get_packets[index];
+            p->instruction.mutable_get_keys(j)->MergeFrom(fetched->kv);
+            if (fetched->value)
+              AttachValue(p, j, fetched->value);
+            if (--keys_left[index] == 0)
+              CompleteGet(p, &packet_stats);
+          }
+        });
+        for (auto itr = key_to_kvalp.begin(); itr != key_to_kvalp.end();
+             ++itr) {
+          if (itr->second.value)
+            Entry::Unref(itr->second.value);
         }
       }
       loop_latency.Increment(t.GetDelay());
@@ -325,6 +1040,65 @@ class MemcacheRouter {
         }
       }
     }
+    delete client;
+  }
+
+  void SnapshotLoop(string path, int interval_s) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    while (true) {
+      int signal = 0;
+      if (interval_s > 0) {
+        timespec timeout = {interval_s, 0};
+        signal = sigtimedwait(&signals, NULL, &timeout);
+      } else {
+        signal = sigwaitinfo(&signals, NULL);
+      }
+      if (signal < 0 && errno == EINTR)
+        continue;
+      SaveSnapshot(path);
+      if (signal > 0) {
+        cout << "Exiting on signal " << signal << endl;
+        _exit(0);
+      }
+    }
+  }
+
+  void SaveSnapshot(const string& path) {
+    Timer t;
+    uint64_t entries = 0;
+    if (!cache_->SaveSnapshot(path, &entries))
+      return;
+    snapshot_save_.Increment(t.GetDelay() / 1000);
+    cout << "Saved " << entries << " cache entries to " << path << " in "
+         << t.GetDelay() / 1000 << " ms" << endl;
+  }
+
+  // Waits for server list changes, and swaps them in without stopping the
+  // workers. Connections get set up here, off the router loop, so the
+  // workers only ever see warm clients.
+  void SwapServers() {
+    unique_lock<mutex> ul(server_list_m_);
+    while (true) {
+      while (!done_ && requested_version_ == config_version_) {
+        server_list_cond_.wait(ul);
+      }
+      if (done_)
+        return;
+
+      memcache_router::Instruction servers(requested_servers_);
+      int version = requested_version_;
+      ul.unlock();
+      Timer t;
+      shared_ptr<ServerConfig> config = BuildConfig(servers, version);
+      ul.lock();
+
+      PublishConfig(config);
+      swap_stats_.Increment(t.GetDelay());
+      cout << "Swapped in server list version " << version << endl;
+    }
   }
 
  private:
@@ -335,10 +1109,195 @@ class MemcacheRouter {
     for (int i = 0; i < num_threads_; ++i) {
       thread_pool_.threads.push_back(thread(&MemcacheRouter::ProcessPackets, this));
     }
+    thread_pool_.threads.push_back(thread(&MemcacheRouter::SwapServers, this));
+  }
+
+  // Queues up a big GET as parts of split_get_keys_ keys each, so several
+  // workers can fetch it at once. The parent stays out of the queue, until
+  // the last part brings it back for the reply.
+  void PushSplit(Packet* p) {
+    const memcache_router::Instruction& instruction = p->instruction;
+    int num_keys = instruction.get_keys_size();
+    int num_parts = (num_keys + split_get_keys_ - 1) / split_get_keys_;
+    split_stats_.Increment(num_parts);
+    p->parts_left.store(num_parts, memory_order_relaxed);
+    // Parts fill in their slots, so they never resize it under each other.
+    if (instruction.value_frames())
+      p->values.resize(num_keys, NULL);
+    for (int first = 0; first < num_keys; first += split_get_keys_) {
+      bool reused = false;
+      Packet* part = packet_pool_.Get(&reused);
+      part->timer = Timer();
+      part->parent = p;
+      part->first_key = first;
+      int last = min(num_keys, first + split_get_keys_);
+      for (int i = first; i < last; ++i) {
+        part->instruction.add_get_keys()->set_key(instruction.get_keys(i).key());
+      }
+      get_queue_.Push(part);
+    }
+  }
+
+  // Moves the part's results into its parent, and recycles the part.
+  // Returns the parent, if this was the last part to finish.
+  Packet* CompletePart(Packet* part) {
+    Packet* parent = part->parent;
+    for (int j = 0; j < part->instruction.get_keys_size(); ++j) {
+      parent->instruction.mutable_get_keys(part->first_key + j)->Swap(
+          part->instruction.mutable_get_keys(j));
+    }
+    packet_pool_.Release(part);
+    if (parent->parts_left.fetch_sub(1, memory_order_acq_rel) != 1)
+      return NULL;
+    return parent;
+  }
+
+  // Hands the cached value of GET key j over to the packet's reply. Big
+  // values go out as frames of their own, if the client takes them, which
+  // keep a reference on the entry instead of a copy of the value.
+  void AttachValue(Packet* p, int j, Entry* entry) {
+    memcache_router::KeyValue* kv = p->instruction.mutable_get_keys(j);
+    Packet* reply = p->parent ? p->parent : p;
+    if (!reply->instruction.value_frames() ||
+        entry->value_size < kMinValueFrameBytes) {
+      kv->set_val(entry->value(), entry->value_size);
+      return;
+    }
+    if (p->parent) {
+      j += p->first_key;
+    } else if (p->values.empty()) {
+      p->values.resize(p->instruction.get_keys_size(), NULL);
+    }
+    entry->Ref();
+    reply->values[j] = entry;
+    value_frames_.Increment(entry->value_size);
+  }
+
+  // Replies to a GET packet, once all its keys are filled in.
+  void CompleteGet(Packet* p, Stats* packet_stats) {
+    if (p->parent) {
+      p = CompletePart(p);
+      if (!p)
+        return;  // Other parts still running.
+    }
+    int delay = p->timer.GetDelay();
+    packet_stats->Increment(delay);
+    get_queue_.RecordGetLatency(delay);
+    Reply(p);
+  }
+
+  // Serves what it can from the cache, and fetches the rest through the
+  // in-flight table. Calls done for each key once it's filled in: right
+  // away for cache hits, and as its server answers for the keys this
+  // worker owns. Keys some other worker is already fetching are waited on
+  // after that. Cache hits are handed out by reference, so they are copied
+  // at most once, into the replies which can't take them as frames.
+  void FetchKeys(MemClient* client, ServerConfig* config,
+                 map<string, FetchedKey>* key_to_kvalp,
+                 const function<void(FetchedKey*)>& done) {
+    map<string, memcache_router::KeyValue> owned_keys;
+    // Keys this worker fetches for everyone, by key.
+    unordered_map<string, pair<FetchedKey*, Flight*> > owned;
+    vector<pair<FetchedKey*, Flight*> > joined;
+    vector<CacheBatchItem> items;
+    vector<FetchedKey*> fetched;
+    items.reserve(key_to_kvalp->size());
+    fetched.reserve(key_to_kvalp->size());
+    for (auto itr = key_to_kvalp->begin(); itr != key_to_kvalp->end(); ++itr) {
+      items.push_back(CacheBatchItem(&itr->first, &itr->second.kv));
+      items.back().by_reference = true;
+      fetched.push_back(&itr->second);
+    }
+    if (cache_) {
+      Timer t;
+      cache_->MultiGet(&items);
+      cache_latency_.Increment(t.GetDelay());
+    }
+
+    for (int i = 0; i < items.size(); ++i) {
+      if (items[i].hit) {
+        fetched[i]->value = items[i].value;
+        done(fetched[i]);
+        continue;
+      }
+
+      const string& key = *items[i].key;
+      Flight* flight = NULL;
+      if (in_flight_.Join(key, &flight)) {
+        owned_keys.insert(make_pair(key, memcache_router::KeyValue()));
+        owned.insert(make_pair(key, make_pair(fetched[i], flight)));
+        coalesced_.Increment(0);
+      } else {
+        joined.push_back(make_pair(fetched[i], flight));
+        coalesced_.Increment(1);
+      }
+    }
+
+    if (!owned.empty()) {
+      Timer t;
+      client->GetKeys(&owned_keys, false,
+                      [&](int server, const vector<const string*>& keys) {
+        config->server_keys[server].Increment(keys.size());
+        config->server_latency[server].Increment(t.GetDelay());
+        // Joiners on other workers get these as soon as this worker does.
+        for (int i = 0; i < keys.size(); ++i) {
+          auto itr = owned.find(*keys[i]);
+          CHECK(itr != owned.end());
+          FetchedKey* key = itr->second.first;
+          key->kv.Swap(&owned_keys[*keys[i]]);
+          in_flight_.Complete(itr->second.second, key->kv);
+          done(key);
+        }
+      });
+    }
+    for (int i = 0; i < joined.size(); ++i) {
+      in_flight_.Wait(joined[i].second, &joined[i].first->kv);
+      done(joined[i].first);
+    }
+  }
+
+  // Connects one client per worker, so the swap costs no latency.
+  shared_ptr<ServerConfig> BuildConfig(
+      const memcache_router::Instruction& servers, int version) {
+    shared_ptr<ServerConfig> config(new ServerConfig(servers, version));
+    if (backend_options_.binary) {
+      config->engine = make_shared<BinaryEngine>(
+          config->servers, backend_options_.connections_per_server);
+    }
+    for (int i = 0; i < num_threads_; ++i) {
+      MemClient* client = new MemClient(cache_, config->engine);
+      client->Init(config->servers);
+      client->Warm();
+      config->warm_clients.push_back(client);
+    }
+    return config;
+  }
+
+  void PublishConfig(shared_ptr<ServerConfig> config) {
+    atomic_store(&config_, config);
+    config_version_.store(config->version, memory_order_release);
+  }
+
+  // Falls back to a cold client, if the warm ones ran out.
+  MemClient* ClientFor(ServerConfig* config) {
+    MemClient* client = config->ClaimClient();
+    if (!client) {
+      client = new MemClient(cache_, config->engine);
+      client->Init(config->servers);
+    }
+    return client;
   }
 
-  Packet* ReceiveOnePacket(void* medium, bool multi_frame = true) {
-    Packet* p = new Packet;
+  // Receives into a recycled packet, and parses straight from the zmq
+  // buffer.
+  Packet* ReceiveOnePacket(Frontend* frontend, void* medium,
+                           bool multi_frame = true) {
+    bool reused = false;
+    Packet* p = packet_pool_.Get(&reused);
+    p->timer = Timer();  // Not since it went back to the pool.
+    p->frontend = frontend->index;
+    Packet::Spares spares = p->SpareKeyValues();
+
     int more = 0;
     bool is_data = !multi_frame;
     do {
@@ -347,27 +1306,30 @@ class MemcacheRouter {
       CHECK(rc == 0);
       rc = zmq_msg_recv(&msg, medium, 0);
       CHECK(rc != -1);
+      more = zmq_msg_more(&msg);
       if (is_data) {
+        p->data_bytes = zmq_msg_size(&msg);
         p->instruction.ParseFromArray(zmq_msg_data(&msg), zmq_msg_size(&msg));
+      } else if (zmq_msg_size(&msg) == 0) {
+        is_data = true;  // Delimiter, data comes next.
       } else {
-        string id(static_cast<char*>(zmq_msg_data(&msg)), zmq_msg_size(&msg));
-        if (id.empty()) {
-          is_data = true;
-        } else {
-          p->frame_ids.push_back(id);
-        }
+        p->AddFrame(&msg);
       }
-      more = zmq_msg_more(&msg);
       zmq_msg_close(&msg);
     } while (more);
+
+    // Pooled objects this packet cost: itself if the pool was empty, and
+    // any KeyValues which couldn't reuse a cleared one.
+    ingest_allocs_.Increment((reused ? 0 : 1) + p->NewKeyValues(spares));
     return p;
   }
 
   void SendFrames(void* worker, Packet* p) {
-    for (int i = 0; i < p->frame_ids.size(); ++i) {
-      string fid = p->frame_ids[i];
-      router_utils::SendHelper(worker, fid, ZMQ_SNDMORE);
+    for (int i = 0; i < p->frames.size(); ++i) {
+      int rc = zmq_msg_send(&p->frames[i], worker, ZMQ_SNDMORE);
+      CHECK(rc != -1);
     }
+    p->CloseFrames();
     router_utils::SendHelper(worker, "", ZMQ_SNDMORE);
   }
 
@@ -376,25 +1338,56 @@ class MemcacheRouter {
     router_utils::SendHelper(worker, "", 0);
   }
 
-  void SendAndDeletePacket(void* worker, Packet* p) {
+  void SendAndReleasePacket(void* worker, Packet* p) {
     SendFrames(worker, p);
-    string data;
-    CHECK(p->instruction.SerializeToString(&data));
-    router_utils::SendHelper(worker, data, 0);
-    delete p;
+    router_utils::SendMessage(worker, p->instruction, 0);
+    packet_pool_.Release(p);
+  }
+
+  // Called from the loop, for replies serialized by a worker. Value frames
+  // follow the reply, and zmq drops their entry once it's done with them.
+  void SendReply(void* worker, Packet* p) {
+    SendFrames(worker, p);
+    int left = p->num_values;
+    int rc = zmq_msg_send(&p->reply, worker, left > 0 ? ZMQ_SNDMORE : 0);
+    CHECK(rc != -1);
+    for (int i = 0; left > 0; ++i) {
+      Entry* entry = p->values[i];
+      if (!entry)
+        continue;
+      p->values[i] = NULL;
+      zmq_msg_t msg;
+      rc = zmq_msg_init_data(&msg, const_cast<char*>(entry->value()),
+                             entry->value_size, &ReleaseValueFrame, entry);
+      CHECK(rc == 0);
+      rc = zmq_msg_send(&msg, worker, --left > 0 ? ZMQ_SNDMORE : 0);
+      CHECK(rc != -1);
+    }
+    packet_pool_.Release(p);
+  }
+
+  // Called from workers. Serialization happens here, in parallel, and the
+  // packet goes back to the loop for sending.
+  void Reply(Packet* p) {
+    p->SerializeReply();
+    frontends_[p->frontend]->replies.Push(p);
   }
 
+  // Compares against the latest requested list, which may still be
+  // warming up.
   // NOTE: This function should already have mutex lock acquired.
   bool IsServerListMatching(Packet* p) {
-    if (!server_list_)
+    if (requested_version_ == 0)
+      return false;
+    if (requested_servers_.servers_size() != p->instruction.servers_size())
       return false;
 
-    for (int i = 0; i < server_list_->instruction.servers_size(); ++i) {
-      if (server_list_->instruction.servers(i).hostname() !=
+    for (int i = 0; i < requested_servers_.servers_size(); ++i) {
+      if (requested_servers_.servers(i).hostname() !=
           p->instruction.servers(i).hostname()) {
         return false;
       }
-      if (server_list_->instruction.servers(i).port() !=
+      if (requested_servers_.servers(i).port() !=
           p->instruction.servers(i).port()) {
         return false;
       }
@@ -404,28 +1397,67 @@ class MemcacheRouter {
 
   void SetMemcacheServers(Packet* p) {
     CHECK(p->GetType() == Packet::SERVER_LIST);
-    {
-      lock_guard<mutex> lk(server_list_m_);
-      if (!IsServerListMatching(p)) {
-        BlockingWait();  // Wait for all threads to die.
-        delete server_list_;
-        server_list_ = new Packet(*p);
-        InitThreads();
-      }
+    lock_guard<mutex> lk(server_list_m_);
+    if (IsServerListMatching(p))
+      return;
+
+    requested_servers_.mutable_servers()->CopyFrom(p->instruction.servers());
+    ++requested_version_;
+    if (requested_version_ == 1) {
+      // First list. There's nothing being served yet, so build it right
+      // here and bring the workers up on it.
+      PublishConfig(BuildConfig(requested_servers_, requested_version_));
+      InitThreads();
+      return;
     }
+    // Workers keep serving from the current list, until SwapServers has
+    // the new one warmed up.
+    server_list_cond_.notify_one();
   }
 
   void PopulateStats(Packet* p) {
     get_queue_.PopulateStats(p);
+    ingest_allocs_.Set(p->instruction.mutable_stats()->mutable_ingest_allocs());
+    swap_stats_.Set(p->instruction.mutable_stats()->mutable_server_swap());
+    coalesced_.Set(p->instruction.mutable_stats()->mutable_get_coalesced());
+    split_stats_.Set(p->instruction.mutable_stats()->mutable_get_split());
+    cache_latency_.Set(p->instruction.mutable_stats()
+        ->mutable_cache_latency());
+    value_frames_.Set(p->instruction.mutable_stats()
+        ->mutable_value_frames());
+    snapshot_save_.Set(p->instruction.mutable_stats()
+        ->mutable_snapshot_save());
+    incr_batch_size_.Set(p->instruction.mutable_stats()
+        ->mutable_incr_batch_size());
+    incr_latency_.Set(p->instruction.mutable_stats()
+        ->mutable_incr_latency());
+    if (snapshot_loaded_ > 0) {
+      p->instruction.mutable_stats()->set_snapshot_loaded(snapshot_loaded_);
+      p->instruction.mutable_stats()->set_snapshot_load_ms(snapshot_load_ms_);
+    }
     batch_size_.Set(p->instruction.mutable_stats()->mutable_batch_size());
     loop_latency_.Set(p->instruction.mutable_stats()->mutable_loop_latency());
     packet_latency_.Set(p->instruction.mutable_stats()
         ->mutable_packet_latency());
     if (cache_) cache_->PopulateStats(p->instruction.mutable_stats());
+
+    shared_ptr<ServerConfig> config = atomic_load(&config_);
+    if (config) {
+      for (int i = 0; i < config->servers.servers_size(); ++i) {
+        memcache_router::ServerStats* stats =
+            p->instruction.mutable_stats()->add_servers();
+        stats->mutable_server()->CopyFrom(config->servers.servers(i));
+        config->server_keys[i].Set(stats->mutable_keys());
+        config->server_latency[i].Set(stats->mutable_latency());
+      }
+    }
   }
 
   Cache* cache_;  // Shared among all threads.
+  PacketPool packet_pool_;
   PCQueue get_queue_;
+  const BackendOptions backend_options_;
+  const int split_get_keys_;
   router_utils::ThreadPool thread_pool_;
   ThreadSafeStats batch_size_;
   ThreadSafeStats loop_latency_;
@@ -433,26 +1465,151 @@ class MemcacheRouter {
   atomic_bool done_;
   int num_threads_;
   memcache_router::Instruction empty_;
-  void* async_;
   void* context_;
-  void* router_;
-  void* worker_output_;
+  vector<Frontend*> frontends_;
+  router_utils::ThreadPool frontend_pool_;
+  router_utils::ThreadPool snapshot_pool_;
+  uint64_t snapshot_loaded_;  // Entries, set before Run.
+  double snapshot_load_ms_;
+
+  AtomicStats ingest_allocs_;
+  AtomicStats swap_stats_;
+  AtomicStats coalesced_;
+  AtomicStats split_stats_;
+  AtomicStats cache_latency_;
+  AtomicStats value_frames_;
+  AtomicStats snapshot_save_;
+  AtomicStats incr_batch_size_;
+  AtomicStats incr_latency_;
+  InFlightTable in_flight_;
 
   mutable mutex server_list_m_;
-  Packet* server_list_;
+  condition_variable server_list_cond_;
+  memcache_router::Instruction requested_servers_;  // GUARDED_BY server_list_m_
+  int requested_version_;  // GUARDED_BY server_list_m_
+  // What workers run with. Only accessed through atomic_load/atomic_store,
+  // with config_version_ letting workers check for changes cheaply.
+  shared_ptr<ServerConfig> config_;
+  atomic_int config_version_;
 };
 
 int main(int argc, char* argv[]) {
-  if (argc < 3) {
+  router_utils::Flags flags(argc, argv);
+  if (flags.positional().size() < 2) {
     cerr << "Usage: " << argv[0] << " <cache size (Set zero to avoid cache)>"
-         << " <num threads>" << endl;
+         << " <num threads> [flags]" << endl;
+    cerr << "Flags:" << endl
+         << "  --cache_huge_pages: Back the cache with huge pages." << endl
+         << "  --cache_max_ttl: Seconds a cached value lives at most. Zero"
+         << " (default) leaves it to the expiry it was set with." << endl
+         << "  --cache_admission: Only let new keys evict others if they are"
+         << " asked for more often (W-TinyLFU)." << endl
+         << "  --cache_buckets: Cache buckets, each with its own lock. Zero"
+         << " (default) for 4 per core." << endl
+         << "  --cache_numa: Spread cache buckets over NUMA nodes (default"
+         << " 1)." << endl
+         << "  --cache_compress_min_bytes: Keep cached values at least this"
+         << " big compressed. Zero (default) disables it." << endl
+         << "  --snapshot: File to load the cache from at startup, and save"
+         << " it to periodically and on SIGTERM/SIGINT. Needs a cache."
+         << endl
+         << "  --snapshot_interval_s: Seconds between snapshots (default 300)."
+         << " Zero only saves on exit." << endl
+         << "  --backend: How to talk to memcached, libmemcached (default)"
+         << " or binary, which pipelines the binary protocol over a few"
+         << " shared connections per server, and sends SETs in bulk. Only"
+         << " binary replies to GETs without waiting on slower servers"
+         << " they have no keys on." << endl
+         << "  --backend_connections: Connections per server for the binary"
+         << " backend (default 2)." << endl
+         << "  --frontends: Number of receive loops. Frontend i listens on"
+         << " ports " << kRouterPort << " and " << kAsyncPort << " plus 2 * i."
+         << endl
+         << "  --get_weight, --set_weight, --incr_weight: Share of worker"
+         << " pops which go to each lane first." << endl
+         << "  --set_batch_keys, --incr_batch_keys: Max keys per SET and"
+         << " INCR batch." << endl
+         << "  --batch_window_us: Max time a worker waits to grow a small GET"
+         << " batch. Zero (default) disables it." << endl
+         << "  --batch_target_keys: Stop waiting once a GET batch has this"
+         << " many keys." << endl
+         << "  --batch_deep_queue: GET lane depth at which workers stop"
+         << " waiting." << endl
+         << "  --split_get_keys: Split bigger GETs into parts of this many"
+         << " keys, fetched by several workers. Zero disables it." << endl
+         << "  --p99_target_us: Shrink the window while GET p99 is above"
+         << " this." << endl;
     return -1;
   }
 
-  uint64_t cache_size = strtoull(argv[1], NULL, 10);
-  int threads = atoi(argv[2]);
-  MemcacheRouter* router = new MemcacheRouter(cache_size, threads);
-  router->Loop();  // This would block forever.
+  CacheOptions cache_options;
+  cache_options.capacity = strtoull(flags.positional()[0].c_str(), NULL, 10);
+  cache_options.huge_pages = flags.GetInt("cache_huge_pages", 0) != 0;
+  cache_options.max_ttl = max(0, flags.GetInt("cache_max_ttl", 0));
+  cache_options.admission = flags.GetInt("cache_admission", 0) != 0;
+  cache_options.num_buckets = max(0, flags.GetInt("cache_buckets", 0));
+  cache_options.numa = flags.GetInt("cache_numa", 1) != 0;
+  cache_options.compress_min_bytes =
+      max(0, flags.GetInt("cache_compress_min_bytes", 0));
+  int threads = atoi(flags.positional()[1].c_str());
+  int frontends = max(1, flags.GetInt("frontends", 1));
+
+  QueueOptions queue_options;
+  LanePolicy* lanes = &queue_options.lanes[0];
+  lanes[GET_LANE].weight = flags.GetInt("get_weight", lanes[GET_LANE].weight);
+  lanes[SET_LANE].weight = flags.GetInt("set_weight", lanes[SET_LANE].weight);
+  lanes[INCR_LANE].weight = flags.GetInt("incr_weight",
+                                         lanes[INCR_LANE].weight);
+  lanes[SET_LANE].max_keys = flags.GetInt("set_batch_keys",
+                                          lanes[SET_LANE].max_keys);
+  lanes[INCR_LANE].max_keys = flags.GetInt("incr_batch_keys",
+                                           lanes[INCR_LANE].max_keys);
+  queue_options.batch_window_us = flags.GetInt(
+      "batch_window_us", queue_options.batch_window_us);
+  queue_options.batch_target_keys = flags.GetInt(
+      "batch_target_keys", queue_options.batch_target_keys);
+  queue_options.batch_deep_queue = max(1, flags.GetInt(
+      "batch_deep_queue", queue_options.batch_deep_queue));
+  queue_options.split_get_keys = flags.GetInt(
+      "split_get_keys", queue_options.split_get_keys);
+  queue_options.p99_target_us = flags.GetInt(
+      "p99_target_us", queue_options.p99_target_us);
+
+  BackendOptions backend_options;
+  string backend = flags.GetString("backend", "libmemcached");
+  if (backend != "libmemcached" && backend != "binary") {
+    cerr << "Unknown backend: " << backend << endl;
+    return -1;
+  }
+  backend_options.binary = backend == "binary";
+  backend_options.connections_per_server = max(1, flags.GetInt(
+      "backend_connections", backend_options.connections_per_server));
+
+  string snapshot = flags.GetString("snapshot", "");
+  int snapshot_interval_s = max(0, flags.GetInt("snapshot_interval_s", 300));
+  if (!snapshot.empty() && cache_options.capacity == 0) {
+    // No snapshot thread would take the signals blocked below.
+    cerr << "--snapshot needs a cache." << endl;
+    return -1;
+  }
+  if (!snapshot.empty()) {
+    // Before any thread is started, so they all inherit the mask and the
+    // snapshot thread is the one to take these.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    CHECK(pthread_sigmask(SIG_BLOCK, &signals, NULL) == 0);
+  }
+
+  MemcacheRouter* router = new MemcacheRouter(cache_options, threads,
+                                              frontends, queue_options,
+                                              backend_options);
+  if (!snapshot.empty()) {
+    router->LoadSnapshot(snapshot);
+    router->StartSnapshots(snapshot, snapshot_interval_s);
+  }
+  router->Run();  // This would block forever.
   router->BlockingWait();
   delete router;
   return 0;
@@ -7,78 +7,142 @@ using namespace std;
 
 #include "memclient.h"
 
-MemClient::MemClient(Cache* cache) : cache_(cache) {
-  memc_ = memcached_create(NULL);
-}
+MemClient::MemClient(Cache* cache, shared_ptr<BinaryEngine> engine)
+    : cache_(cache), engine_(engine) {}
 
 MemClient::~MemClient() {
-  memcached_server_free(servers_);
-  memcached_free(memc_);
+  for (int i = 0; i < memcs_.size(); ++i) {
+    memcached_free(memcs_[i]);
+  }
 }
 
 void MemClient::Init(const memcache_router::Instruction& instruction) {
-  memcached_return_t rc;
+  if (engine_)
+    return;  // Set up with its servers already.
+  CHECK(instruction.servers_size() > 0);
+  ring_.reset(new ConsistentHash(instruction.servers()));
 
-  rc = memcached_behavior_set(memc_, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
-  CHECK(rc == MEMCACHED_SUCCESS);
-  rc = memcached_behavior_set(memc_, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
-  CHECK(rc == MEMCACHED_SUCCESS);
-  // rc = memcached_behavior_set(memc_, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
-  // CHECK(rc == MEMCACHED_SUCCESS);
-  // Don't set MEMCACHED_BEHAVIOR_NOREPLY as it causes increment
-  // and decrement operations to not return any value.
+  // One handle per server, as the ring rather than libmemcached picks the
+  // server for each key.
+  for (int i = 0; i < instruction.servers_size(); ++i) {
+    memcached_st* memc = memcached_create(NULL);
+    memcached_return_t rc;
 
-  CHECK(instruction.servers_size() > 0);
-  servers_ = memcached_server_list_append(NULL, instruction.servers(0).hostname().c_str(),
-                                          instruction.servers(0).port(), &rc);
-  CHECK(rc == MEMCACHED_SUCCESS);
+    rc = memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
+    CHECK(rc == MEMCACHED_SUCCESS);
+    rc = memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
+    CHECK(rc == MEMCACHED_SUCCESS);
+    // rc = memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+    // CHECK(rc == MEMCACHED_SUCCESS);
+    // Don't set MEMCACHED_BEHAVIOR_NOREPLY as it causes increment
+    // and decrement operations to not return any value.
 
-  for (int i = 1; i < instruction.servers_size(); ++i) {
-    servers_ = memcached_server_list_append(servers_, instruction.servers(0).hostname().c_str(),
-                                            instruction.servers(0).port(), &rc);
+    memcached_server_st* servers = memcached_server_list_append(
+        NULL, instruction.servers(i).hostname().c_str(),
+        instruction.servers(i).port(), &rc);
     CHECK(rc == MEMCACHED_SUCCESS);
+    rc = memcached_server_push(memc, servers);
+    CHECK(rc == MEMCACHED_SUCCESS);
+    memcached_server_list_free(servers);  // Pushing copies it.
+    memcs_.push_back(memc);
   }
-  rc = memcached_server_push(memc_, servers_);
-  CHECK(rc == MEMCACHED_SUCCESS);
 }
 
-void MemClient::GetKeys(map<string, memcache_router::KeyValue>* key_to_kvalp) {
-  char** keys = new char* [key_to_kvalp->size()];
-  size_t key_length[key_to_kvalp->size()];
-  int num_keys = 0;
-
-  int i = 0;
-  bool fetch_from_memcached = false;
-  for (auto itr = key_to_kvalp->begin(); itr != key_to_kvalp->end(); ++itr) {
-    memcache_router::KeyValue& kv = itr->second;
-    if (cache_ && cache_->Get(itr->first, &kv)) {
-      // Filled from cache, no need to send to server.
-      continue;
+void MemClient::Warm() {
+  if (engine_) {
+    engine_->Warm();
+    return;
+  }
+  // Version goes out to the server, which forces the connection open.
+  for (int i = 0; i < memcs_.size(); ++i) {
+    memcached_return_t rc = memcached_version(memcs_[i]);
+    if (rc != MEMCACHED_SUCCESS) {
+      cerr << "Warm up failed: " << memcached_strerror(memcs_[i], rc) << endl;
     }
+  }
+}
 
-    fetch_from_memcached = true;
-    ++num_keys;
-    keys[i] = new char[itr->first.length() + 1];
-    strcpy(keys[i], itr->first.c_str());
-    key_length[i] = itr->first.length();
-    ++i;
+void MemClient::GetKeys(map<string, memcache_router::KeyValue>* key_to_kvalp,
+                        bool check_cache, const ServerDone& server_done) {
+  vector<CacheBatchItem> items;
+  items.reserve(key_to_kvalp->size());
+  for (auto itr = key_to_kvalp->begin(); itr != key_to_kvalp->end(); ++itr) {
+    items.push_back(CacheBatchItem(&itr->first, &itr->second));
   }
+  if (check_cache && cache_)
+    cache_->MultiGet(&items);
 
-  // If all the keys are served from cache, there's no need for a round trip
-  // to the memcached servers.
-  if (!fetch_from_memcached)
+  if (engine_) {
+    GetFromEngine(items, server_done);
     return;
+  }
 
-  memcached_return_t rc = memcached_mget(memc_, keys, key_length, num_keys);
-  if (rc != MEMCACHED_SUCCESS) {
-    cerr << "return code: " << rc << endl;
-    CHECK(rc == MEMCACHED_SUCCESS);
+  // Keys served from cache need no round trip to the memcached servers.
+  vector<int> missed;
+  vector<const string*> missed_keys;
+  for (int j = 0; j < items.size(); ++j) {
+    if (!items[j].hit) {
+      missed.push_back(j);
+      missed_keys.push_back(items[j].key);
+    }
+  }
+  vector<int> servers;
+  ring_->IndexesForKeys(missed_keys, &servers);
+  vector<vector<int> > by_server(memcs_.size());
+  for (int i = 0; i < missed.size(); ++i) {
+    by_server[servers[i]].push_back(missed[i]);
+  }
+
+  // Every server gets its mget before any results are read, so they all
+  // work on them at the same time.
+  vector<memcached_return_t> sent(memcs_.size(), MEMCACHED_SUCCESS);
+  for (int s = 0; s < by_server.size(); ++s) {
+    if (by_server[s].empty())
+      continue;
+    vector<const char*> keys;
+    vector<size_t> key_length;
+    for (int i = 0; i < by_server[s].size(); ++i) {
+      const string& key = *items[by_server[s][i]].key;
+      keys.push_back(key.c_str());
+      key_length.push_back(key.size());
+    }
+    sent[s] = memcached_mget(memcs_[s], keys.data(), key_length.data(),
+                             keys.size());
+  }
+
+  // Read in server order, as libmemcached has no way to tell which server
+  // answers first. See GetKeys in memclient.h.
+  for (int s = 0; s < by_server.size(); ++s) {
+    if (by_server[s].empty())
+      continue;
+    if (sent[s] == MEMCACHED_SUCCESS) {
+      FetchResults(memcs_[s], key_to_kvalp);
+    } else {
+      cerr << "return code: " << sent[s] << endl;
+      for (int i = 0; i < by_server[s].size(); ++i) {
+        memcache_router::KeyValue* kv = items[by_server[s][i]].kv;
+        kv->set_return_code(sent[s]);
+        kv->set_return_error(memcached_strerror(memcs_[s], sent[s]));
+      }
+    }
+    if (server_done) {
+      vector<const string*> keys;
+      for (int i = 0; i < by_server[s].size(); ++i) {
+        keys.push_back(items[by_server[s][i]].key);
+      }
+      server_done(s, keys);
+    }
   }
+}
 
+void MemClient::FetchResults(
+    memcached_st* memc, map<string, memcache_router::KeyValue>* key_to_kvalp) {
   // Should use memcached_fetch_result instead.
   // And use memcached_result_cas with the result to find cas id.
+  memcached_return_t rc;
   memcached_result_st* result = NULL;
-  while (result = memcached_fetch_result(memc_, NULL, &rc)) {
+  vector<CacheBatchItem> fetched;
+  while (result = memcached_fetch_result(memc, NULL, &rc)) {
     string key(memcached_result_key_value(result),
                memcached_result_key_length(result));
     auto itr = key_to_kvalp->find(key);
@@ -90,67 +154,107 @@ void MemClient::GetKeys(map<string, memcache_router::KeyValue>* key_to_kvalp) {
     kv.set_flags(memcached_result_flags(result));
     kv.set_cas(memcached_result_cas(result));
     kv.set_return_code(rc);
-    kv.set_return_error(memcached_strerror(memc_, rc));
+    kv.set_return_error(memcached_strerror(memc, rc));
     free(result);
 
     if (cache_)
-      cache_->AddOrReplace(key, kv);
+      fetched.push_back(CacheBatchItem(&itr->first, &kv));
   }
+  if (cache_)
+    cache_->MultiAddOrReplace(fetched);
 }
 
 void MemClient::SetKeys(memcache_router::Instruction* instruction) {
-  // TODO(manish): Find a way to send a single RPC for setting multiple keys.
-  for (int i = 0; i < instruction->set_keys_size(); ++i)  {
-    memcache_router::KeyValue* kv = instruction->mutable_set_keys(i);
-    if (cache_)
-      cache_->AddOrReplace(kv->key(), *kv);
+  vector<memcache_router::KeyValue*> kvs;
+  kvs.reserve(instruction->set_keys_size());
+  for (int i = 0; i < instruction->set_keys_size(); ++i) {
+    kvs.push_back(instruction->mutable_set_keys(i));
+  }
+  SetKeys(kvs);
+}
+
+void MemClient::SetKeys(const vector<memcache_router::KeyValue*>& kvs) {
+  if (cache_) {
+    vector<CacheBatchItem> items;
+    items.reserve(kvs.size());
+    for (int i = 0; i < kvs.size(); ++i) {
+      items.push_back(CacheBatchItem(&kvs[i]->key(), kvs[i]));
+    }
+    cache_->MultiAddOrReplace(items);
+  }
+
+  if (engine_) {
+    // One pipelined write per server, replied to only on errors.
+    vector<memcache_router::KeyValue*> propagated;
+    propagated.reserve(kvs.size());
+    for (int i = 0; i < kvs.size(); ++i) {
+      if (!kvs[i]->no_propagate())
+        propagated.push_back(kvs[i]);
+    }
+    if (!propagated.empty())
+      engine_->Store(propagated);
+    return;
+  }
+
+  // One round trip per key. The binary backend sends them in bulk instead.
+  for (int i = 0; i < kvs.size(); ++i)  {
+    memcache_router::KeyValue* kv = kvs[i];
 
     if (kv->no_propagate()) {
       // don't forward to memcached servers.
       continue;
     }
 
+    memcached_st* memc = MemcFor(kv->key());
     memcached_return_t rc;
     if (kv->cas() > 0) {
       rc = memcached_cas(
-          memc_, kv->key().c_str(), kv->key().size(),
+          memc, kv->key().c_str(), kv->key().size(),
           kv->val().c_str(), kv->val().size(),
           (time_t) kv->expire_in_seconds(), kv->flags(), kv->cas());
 
     } else if (!kv->allow_replace()) {
       rc = memcached_add(
-          memc_, kv->key().c_str(), kv->key().size(),
+          memc, kv->key().c_str(), kv->key().size(),
           kv->val().c_str(), kv->val().size(),
           (time_t) kv->expire_in_seconds(), kv->flags());
 
     } else {
       rc = memcached_set(
-          memc_, kv->key().c_str(), kv->key().size(),
+          memc, kv->key().c_str(), kv->key().size(),
           kv->val().c_str(), kv->val().size(),
           (time_t) kv->expire_in_seconds(), kv->flags());
     }
     kv->set_return_code(rc);
-    kv->set_return_error(memcached_strerror(memc_, rc));
+    kv->set_return_error(memcached_strerror(memc, rc));
   }
 }
 
-void MemClient::IncrKeys(memcache_router::Instruction* instruction) {
-  for (int i = 0; i < instruction->incr_keys_size(); ++i) {
-    memcache_router::KeyValue* kv = instruction->mutable_incr_keys(i);
+void MemClient::IncrKeys(const vector<memcache_router::KeyValue*>& kvs) {
+  if (engine_) {
+    // Pipelined, one write per server.
+    if (!kvs.empty())
+      engine_->Arithmetic(kvs);
+    return;
+  }
+
+  for (int i = 0; i < kvs.size(); ++i) {
+    memcache_router::KeyValue* kv = kvs[i];
     // No application of cache for this method for now.
 
+    memcached_st* memc = MemcFor(kv->key());
     uint64_t val = 0;
     memcached_return_t rc;
     if (kv->offset() >= 0) {
       // increment.
       if (kv->has_default_counter_val()) {
         rc = memcached_increment_with_initial(
-            memc_, kv->key().c_str(), kv->key().size(),
+            memc, kv->key().c_str(), kv->key().size(),
             kv->offset(), kv->default_counter_val(),
             (time_t)kv->expire_in_seconds(), &val);
       } else {
         rc = memcached_increment(
-            memc_, kv->key().c_str(), kv->key().size(),
+            memc, kv->key().c_str(), kv->key().size(),
             kv->offset(), &val);
       }
 
@@ -159,18 +263,54 @@ void MemClient::IncrKeys(memcache_router::Instruction* instruction) {
       unsigned int offset = abs(kv->offset());
       if (kv->has_default_counter_val()) {
         rc = memcached_decrement_with_initial(
-            memc_, kv->key().c_str(), kv->key().size(),
+            memc, kv->key().c_str(), kv->key().size(),
             offset, kv->default_counter_val(),
             (time_t)kv->expire_in_seconds(), &val);
       } else {
         rc = memcached_decrement(
-            memc_, kv->key().c_str(), kv->key().size(),
+            memc, kv->key().c_str(), kv->key().size(),
             offset, &val);
       }
     }
     kv->set_counter_val(val);
     kv->set_return_code(rc);
-    kv->set_return_error(memcached_strerror(memc_, rc));
+    kv->set_return_error(memcached_strerror(memc, rc));
   }
 }
 
+
+void MemClient::GetFromEngine(const vector<CacheBatchItem>& items,
+                              const ServerDone& server_done) {
+  vector<memcache_router::KeyValue*> kvs;
+  vector<int> indexes;
+  for (int j = 0; j < items.size(); ++j) {
+    if (items[j].hit)
+      continue;
+    // The engine picks the server from the key.
+    items[j].kv->set_key(*items[j].key);
+    kvs.push_back(items[j].kv);
+    indexes.push_back(j);
+  }
+  if (kvs.empty())
+    return;
+
+  vector<bool> hits;
+  engine_->Get(kvs, &hits, [&](int server, const vector<int>& done) {
+    vector<CacheBatchItem> fetched;
+    vector<const string*> keys;
+    for (int i = 0; i < done.size(); ++i) {
+      const CacheBatchItem& item = items[indexes[done[i]]];
+      keys.push_back(item.key);
+      if (cache_ && hits[done[i]])
+        fetched.push_back(CacheBatchItem(item.key, item.kv));
+    }
+    if (cache_)
+      cache_->MultiAddOrReplace(fetched);
+    if (server_done)
+      server_done(server, keys);
+  });
+}
+
+memcached_st* MemClient::MemcFor(const string& key) const {
+  return memcs_[ring_->IndexForKey(key)];
+}
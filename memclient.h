@@ -1,5 +1,9 @@
+#include <functional>
 #include <libmemcached/memcached.h>
+#include <memory>
 
+#include "binary_engine.h"
+#include "consistent_hash.h"
 #include "lru_cache.h"
 #include "memdata.pb.h"
 
@@ -8,15 +12,44 @@ using namespace std;
 // This class is not thread safe.
 class MemClient {
  public:
-  explicit MemClient(Cache* cache);
+  // Told about each server's keys, hits and misses alike, as soon as that
+  // server has answered them all.
+  typedef function<void(int server, const vector<const string*>& keys)>
+      ServerDone;
+
+  // With an engine, memcached is reached through it instead of libmemcached.
+  explicit MemClient(Cache* cache,
+                     shared_ptr<BinaryEngine> engine = nullptr);
   ~MemClient();
   void Init(const memcache_router::Instruction& instruction);
-  void GetKeys(map<string, memcache_router::KeyValue>* key_to_kvalp);
+  // Connects to all the servers ahead of the first request.
+  void Warm();
+  // Set check_cache to false, if the caller has already looked the keys up.
+  // Keys go to their servers on the ketama ring, all at once. server_done
+  // is indexed like the server list given to Init. With an engine, it hears
+  // about each server as soon as that server has answered. libmemcached
+  // doesn't let us poll its sockets, so without one the servers are read
+  // in order, and a slow server holds up the ones after it.
+  void GetKeys(map<string, memcache_router::KeyValue>* key_to_kvalp,
+               bool check_cache = true,
+               const ServerDone& server_done = nullptr);
   void SetKeys(memcache_router::Instruction* instruction);
-  void IncrKeys(memcache_router::Instruction* instruction);
+  // Sets from any number of packets, which get sent together.
+  void SetKeys(const vector<memcache_router::KeyValue*>& kvs);
+  // Counters from any number of packets, which get sent together.
+  void IncrKeys(const vector<memcache_router::KeyValue*>& kvs);
 
  private:
+  // Fetches the items the cache missed through engine_.
+  void GetFromEngine(const vector<CacheBatchItem>& items,
+                     const ServerDone& server_done);
+  // Reads the results of an mget on memc into key_to_kvalp.
+  void FetchResults(memcached_st* memc,
+                    map<string, memcache_router::KeyValue>* key_to_kvalp);
+  memcached_st* MemcFor(const string& key) const;
+
   Cache* cache_;  // not owned here.
-  memcached_server_st* servers_;
-  memcached_st* memc_;
+  shared_ptr<BinaryEngine> engine_;  // Shared with the other clients.
+  unique_ptr<ConsistentHash> ring_;
+  vector<memcached_st*> memcs_;  // One per server, in the ring's order.
 };
@@ -22,6 +22,8 @@ def my_module_gen(out_file):
                   [Parameter.new('const std::string&', 'hostname'),
                    Parameter.new('int', 'port')])
     cl.add_method('send_host_list', None, [])
+    cl.add_method('connect_frontends', None,
+                  [param('int', 'num_frontends')])
 
     # GET functions
     cl.add_method('get', retval('PyObject*', caller_owns_return=True),
@@ -0,0 +1,177 @@
+#ifndef MEMCACHE_ROUTER_MPMC_QUEUE_H
+#define MEMCACHE_ROUTER_MPMC_QUEUE_H
+
+/*
+ * Bounded lock free multi-producer multi-consumer ring buffer, based upon
+ * Dmitry Vyukov's design. Every slot carries a sequence number, which tells
+ * producers and consumers whether the slot is ready for them. So the only
+ * contended write on the fast path is one CAS on the enqueue (or dequeue)
+ * position.
+ *
+ * EventCount lets consumers park on a futex when the ring is empty, and lets
+ * producers skip the wake up syscall entirely when nobody is parked.
+ */
+
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+const int kCacheLineSize = 64;
+
+template <typename T>
+class MPMCQueue {
+ public:
+  // Capacity is rounded up to the next power of 2.
+  explicit MPMCQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    mask_ = size - 1;
+    slots_ = new Slot[size];
+    for (size_t i = 0; i < size; ++i) {
+      slots_[i].seq.store(i, memory_order_relaxed);
+    }
+    enqueue_pos_.store(0, memory_order_relaxed);
+    dequeue_pos_.store(0, memory_order_relaxed);
+  }
+
+  ~MPMCQueue() {
+    delete[] slots_;
+  }
+
+  // Returns false if the ring is full.
+  bool TryPush(const T& data) {
+    Slot* slot;
+    size_t pos = enqueue_pos_.load(memory_order_relaxed);
+    while (true) {
+      slot = &slots_[pos & mask_];
+      size_t seq = slot->seq.load(memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(memory_order_relaxed);
+      }
+    }
+    slot->data = data;
+    slot->seq.store(pos + 1, memory_order_release);
+    return true;
+  }
+
+  // Returns false if the ring is empty.
+  bool TryPop(T* data) {
+    Slot* slot;
+    size_t pos = dequeue_pos_.load(memory_order_relaxed);
+    while (true) {
+      slot = &slots_[pos & mask_];
+      size_t seq = slot->seq.load(memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) -
+                      static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(memory_order_relaxed);
+      }
+    }
+    *data = slot->data;
+    slot->seq.store(pos + mask_ + 1, memory_order_release);
+    return true;
+  }
+
+  // Only a hint, as both ends keep moving while this is computed.
+  size_t ApproxSize() const {
+    size_t enqueued = enqueue_pos_.load(memory_order_relaxed);
+    size_t dequeued = dequeue_pos_.load(memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+ private:
+  struct Slot {
+    atomic<size_t> seq;
+    T data;
+  };
+
+  Slot* slots_;
+  size_t mask_;
+  // Keep producers and consumers off each other's cache lines. Padding is
+  // spelled out, since new doesn't honour alignas until C++17.
+  char pad0_[kCacheLineSize];
+  atomic<size_t> enqueue_pos_;
+  char pad1_[kCacheLineSize - sizeof(atomic<size_t>)];
+  atomic<size_t> dequeue_pos_;
+  char pad2_[kCacheLineSize - sizeof(atomic<size_t>)];
+};
+
+// Usage from the waiting side:
+//   uint32_t epoch = ec.PrepareWait();
+//   if (condition is now true) ec.CancelWait(); else ec.Wait(epoch);
+// The condition must be rechecked after PrepareWait, otherwise a Notify
+// which lands in between would be missed.
+class EventCount {
+ public:
+  EventCount() : epoch_(0), waiters_(0) {}
+
+  uint32_t PrepareWait() {
+    waiters_.fetch_add(1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return epoch_.load(memory_order_acquire);
+  }
+
+  void CancelWait() {
+    waiters_.fetch_sub(1);
+  }
+
+  void Wait(uint32_t epoch) {
+    syscall(SYS_futex, &epoch_, FUTEX_WAIT_PRIVATE, epoch, NULL, NULL, 0);
+    waiters_.fetch_sub(1);
+  }
+
+  // Same as Wait, but gives up after timeout_us.
+  void WaitFor(uint32_t epoch, int timeout_us) {
+    struct timespec timeout;
+    timeout.tv_sec = timeout_us / 1000000;
+    timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+    syscall(SYS_futex, &epoch_, FUTEX_WAIT_PRIVATE, epoch, &timeout, NULL, 0);
+    waiters_.fetch_sub(1);
+  }
+
+  void NotifyOne() {
+    Notify(1);
+  }
+
+  void NotifyAll() {
+    Notify(INT_MAX);
+  }
+
+ private:
+  void Notify(int num_threads) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (waiters_.load(memory_order_relaxed) == 0)
+      return;  // Nobody parked, save the syscall.
+    epoch_.fetch_add(1, memory_order_release);
+    syscall(SYS_futex, &epoch_, FUTEX_WAKE_PRIVATE, num_threads,
+            NULL, NULL, 0);
+  }
+
+  atomic<uint32_t> epoch_;  // Futex word.
+  atomic<int> waiters_;
+};
+
+#endif
@@ -1,16 +1,40 @@
+
 #include "protocol.h"
 
 #include <endian.h>
 #include <netinet/in.h>
 
+namespace {
+
+// Adds what's at or past offset of size bytes at data, which sit at
+// *position in the packet. Bytes before offset are already sent, and data
+// isn't touched if all of them are.
+void AddIovec(const char* data, size_t size, size_t offset, size_t* position,
+              struct iovec* iovecs, int* n) {
+  if (size > 0 && *position + size > offset) {
+    size_t skip = offset > *position ? offset - *position : 0;
+    iovecs[*n].iov_base = const_cast<char*>(data + skip);
+    iovecs[*n].iov_len = size - skip;
+    ++*n;
+  }
+  *position += size;
+}
+
+}  // namespace
+
 int ParseHeader(const string& response, int pos,
                  ProtocolHeader* header) {
   if (response.size() < pos + sizeof(ProtocolHeader)) {
     return false;
   }
 
-  memcpy(header, const_cast<char*>(response.c_str() + pos),
-         sizeof(ProtocolHeader));
+  DecodeHeader(response.data() + pos, header);
+  CHECK(header->magic == RESPONSE);
+  return pos + sizeof(ProtocolHeader) + header->total_body_length;
+}
+
+void DecodeHeader(const char* data, ProtocolHeader* header) {
+  memcpy(header, data, sizeof(ProtocolHeader));
 
   // Convert from network standard big endian ordering to host endian ordering.
   header->key_length = be16toh(header->key_length);
@@ -18,10 +42,6 @@ int ParseHeader(const string& response, int pos,
   header->total_body_length = be32toh(header->total_body_length);
   header->opaque = be32toh(header->opaque);
   header->cas = be64toh(header->cas);
-
-  cout << "header magic: " << (int) header->magic << endl;
-  CHECK(header->magic == RESPONSE);
-  return pos + sizeof(ProtocolHeader) + header->total_body_length;
 }
 
 void RequestPacket::PrintHex() const {
@@ -36,59 +56,90 @@ void RequestPacket::PrintHex() const {
   cout << endl;
 }
 
-void RequestPacket::Get(const string& key) {
+void RequestPacket::Get(const string& key, uint8_t opcode, uint32_t opaque) {
   ++num_;
-  ProtocolHeader header;
-  ResetHeader(&header);
-
-  header.magic = REQUEST;
-  header.opcode = GET;
-  header.key_length = htobe16(key.size());
-  header.total_body_length = htobe32(key.size());
-
-  char buf[24];
-  memcpy(&buf, &header, 24);
-  command_.append(buf, 24);
+  AppendHeader(opcode, key.size(), 0, key.size(), 0, opaque);
   command_.append(key);
 }
 
 void RequestPacket::Set(const string& key, const string& value,
-                        uint32_t flag, uint32_t expiry, uint64_t cas) {
+                        uint32_t flag, uint32_t expiry, uint64_t cas,
+                        uint8_t opcode, uint32_t opaque,
+                        bool by_reference) {
   ++num_;
-  ProtocolHeader header;
-  ResetHeader(&header);
-
-  header.magic = REQUEST;
-  header.opcode = SET;
-  header.key_length = htobe16(key.size());
-  header.extra_length = 8;  // 4 byte flag + 4 byte expiry.
-  header.total_body_length = htobe32(key.size() + value.size() + 8);
-  header.cas = htobe64(cas);
-  char buf[24];
-  memcpy(&buf, &header, 24);
-  command_.append(buf, 24);
-
-  uint32_t be_flag = htobe32(flag);
-  memcpy(&buf, &be_flag, 4);
-  command_.append(buf, 4);
-
-  uint32_t be_expiry = htobe32(expiry);
-  memcpy(&buf, &be_expiry, 4);
-  command_.append(buf, 4);
+  // 4 byte flag + 4 byte expiry.
+  AppendHeader(opcode, key.size(), 8, key.size() + value.size() + 8, cas,
+               opaque);
+  AppendUint32(flag);
+  AppendUint32(expiry);
+  command_.append(key);
+  if (by_reference) {
+    Value reference = {command_.size(), value.data(), value.size()};
+    values_.push_back(reference);
+    value_bytes_ += value.size();
+  } else {
+    command_.append(value);
+  }
+}
 
+void RequestPacket::Arithmetic(const string& key, uint64_t delta,
+                               uint64_t initial, uint32_t expiry,
+                               uint8_t opcode, uint32_t opaque) {
+  ++num_;
+  // 8 byte delta + 8 byte initial value + 4 byte expiry.
+  AppendHeader(opcode, key.size(), 20, key.size() + 20, 0, opaque);
+  AppendUint64(delta);
+  AppendUint64(initial);
+  AppendUint32(expiry);
   command_.append(key);
-  command_.append(value);
 }
 
-void RequestPacket::Noop() {
+void RequestPacket::Noop(uint32_t opaque) {
   ++num_;
+  AppendHeader(NOOP, 0, 0, 0, 0, opaque);
+}
+
+int RequestPacket::Iovecs(size_t offset, struct iovec* iovecs,
+                          int max_iovecs) const {
+  int n = 0;
+  size_t position = 0;  // In the packet, with the values.
+  size_t begin = 0;  // In command_.
+  for (int i = 0; i <= values_.size() && n < max_iovecs; ++i) {
+    // The part of command_ up to the value, then the value.
+    size_t end = i < values_.size() ? values_[i].position : command_.size();
+    AddIovec(command_.data() + begin, end - begin, offset, &position,
+             iovecs, &n);
+    if (i < values_.size() && n < max_iovecs) {
+      AddIovec(values_[i].data, values_[i].size, offset, &position, iovecs,
+               &n);
+    }
+    begin = end;
+  }
+  return n;
+}
+
+void RequestPacket::AppendHeader(uint8_t opcode, uint16_t key_length,
+                                 uint8_t extra_length,
+                                 uint32_t total_body_length, uint64_t cas,
+                                 uint32_t opaque) {
   ProtocolHeader header;
   ResetHeader(&header);
   header.magic = REQUEST;
-  header.opcode = NOOP;
+  header.opcode = opcode;
+  header.key_length = htobe16(key_length);
+  header.extra_length = extra_length;
+  header.total_body_length = htobe32(total_body_length);
+  header.opaque = htobe32(opaque);
+  header.cas = htobe64(cas);
+  command_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+}
 
-  char buf[24];
-  memcpy(&buf, &header, 24);
-  command_.append(buf, 24);
+void RequestPacket::AppendUint32(uint32_t value) {
+  uint32_t be_value = htobe32(value);
+  command_.append(reinterpret_cast<const char*>(&be_value), 4);
 }
 
+void RequestPacket::AppendUint64(uint64_t value) {
+  uint64_t be_value = htobe64(value);
+  command_.append(reinterpret_cast<const char*>(&be_value), 8);
+}
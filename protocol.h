@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <string>
+#include <sys/uio.h>
+#include <utility>
+#include <vector>
 
 #include "utils.h"
 
@@ -39,6 +42,23 @@ enum Commands {
   PREPENDQ
 };
 
+// Status of a response, in place of the request's reserved field.
+enum ResponseStatus {
+  STATUS_OK = 0x00,
+  STATUS_NOT_FOUND = 0x01,
+  STATUS_EXISTS = 0x02,
+  STATUS_TOO_LARGE = 0x03,
+  STATUS_INVALID_ARGUMENTS = 0x04,
+  STATUS_NOT_STORED = 0x05,
+  STATUS_NON_NUMERIC = 0x06,
+  STATUS_UNKNOWN_COMMAND = 0x81,
+  STATUS_OUT_OF_MEMORY = 0x82,
+};
+
+// Expiration which keeps INCREMENT and DECREMENT from creating missing
+// counters.
+const uint32_t kNoInitialValue = 0xFFFFFFFF;
+
 // This is a 24 byte header.
 struct ProtocolHeader {
   // Don't add any functions here. Keep it POD.
@@ -53,7 +73,7 @@ struct ProtocolHeader {
   uint64_t cas;
 };
 
-static void ResetHeader(ProtocolHeader* header) {
+inline void ResetHeader(ProtocolHeader* header) {
   header->magic = 0;
   header->opcode = 0;
   header->key_length = 0;
@@ -67,35 +87,76 @@ static void ResetHeader(ProtocolHeader* header) {
 
 int ParseHeader(const string& response, int pos,
                 ProtocolHeader* header);
+// Copies the header out of data, which holds at least sizeof(ProtocolHeader)
+// bytes, and converts it to host byte order.
+void DecodeHeader(const char* data, ProtocolHeader* header);
 
 class RequestPacket {
  public:
-  RequestPacket() : num_(0) {}
+  RequestPacket() : num_(0), value_bytes_(0) {}
 
   void Reset() {
     command_.clear();
+    values_.clear();
     num_ = 0;
+    value_bytes_ = 0;
   }
 
-  void Noop();
-  void Get(const string& key);
+  // The opaque is echoed back in the response, to match it up with its
+  // request.
+  void Noop(uint32_t opaque = 0);
+  void Get(const string& key, uint8_t opcode = GET, uint32_t opaque = 0);
+  // SET, ADD or REPLACE, or their quiet versions. A value taken by
+  // reference isn't copied, and its bytes have to stay put until they are
+  // sent. They aren't looked at again after that, so the value may go
+  // away while later commands are still unsent.
   void Set(const string& key, const string& value,
-           uint32_t flag, uint32_t expiry, uint64_t cas);
-
+           uint32_t flag, uint32_t expiry, uint64_t cas,
+           uint8_t opcode = SET, uint32_t opaque = 0,
+           bool by_reference = false);
+  // INCREMENT or DECREMENT, or their quiet versions.
+  void Arithmetic(const string& key, uint64_t delta, uint64_t initial,
+                  uint32_t expiry, uint8_t opcode, uint32_t opaque = 0);
+
+  // The packet, less any values taken by reference.
   const string& Command() {
     return command_;
   }
 
+  // Bytes in the packet, with the values taken by reference.
+  size_t Size() const {
+    return command_.size() + value_bytes_;
+  }
+
+  // Fills in up to max_iovecs pieces of the packet from byte offset on,
+  // for writev. Returns how many were filled in.
+  int Iovecs(size_t offset, struct iovec* iovecs, int max_iovecs) const;
+
   int NumCommands() const {
-    cout << "Num commmands: " << num_ << endl;
     return num_;
   }
 
   void PrintHex() const;
 
  private:
+  void AppendHeader(uint8_t opcode, uint16_t key_length, uint8_t extra_length,
+                    uint32_t total_body_length, uint64_t cas,
+                    uint32_t opaque);
+  void AppendUint32(uint32_t value);
+  void AppendUint64(uint64_t value);
+
+  // A value taken by reference. Its string isn't kept, as it may be gone
+  // by the time the commands after it are sent.
+  struct Value {
+    size_t position;  // Where in command_ it goes.
+    const char* data;
+    size_t size;
+  };
+
   string command_;
+  vector<Value> values_;
   int num_;
+  size_t value_bytes_;
 };
 
 #endif
@@ -0,0 +1,314 @@
+#include "slab.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <linux/mempolicy.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+namespace {
+
+const size_t kMinChunkSize = 64;
+const double kChunkGrowth = 1.125;
+// Transparent huge pages are 2MB, so arenas are aligned to that.
+const size_t kHugePageSize = 2 << 20;
+// Chunks start past the page header, at this alignment.
+const size_t kChunkAlign = 16;
+
+size_t RoundUp(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+const size_t kPageHeaderSize = RoundUp(sizeof(SlabPage), kChunkAlign);
+const size_t kMaxChunkSize = kSlabPageSize - kPageHeaderSize;
+
+// Precedes allocations which fell back to malloc, so they can be freed
+// without knowing their allocator.
+struct MallocHeader {
+  SlabAllocator* owner;
+  size_t size;  // Including this header.
+};
+
+const size_t kMallocHeaderSize = RoundUp(sizeof(MallocHeader), kChunkAlign);
+
+SlabPage* PageOf(const void* chunk) {
+  return reinterpret_cast<SlabPage*>(
+      reinterpret_cast<uintptr_t>(chunk) & ~(kSlabPageSize - 1));
+}
+
+// Prefers node for the range's pages, as they get faulted in. Called
+// directly, so there's no need for libnuma.
+void BindToNode(void* base, size_t size, int node) {
+  unsigned long mask = 1UL << node;
+  if (syscall(SYS_mbind, base, size, MPOL_PREFERRED, &mask,
+              sizeof(mask) * 8, 0) != 0) {
+    perror("mbind");
+  }
+}
+
+}  // namespace
+
+int NumaNodes() {
+  // Online nodes, as a list of ranges like "0-3" or "0,2". Nodes are
+  // numbered from 0, so the highest one is all that's needed.
+  FILE* f = fopen("/sys/devices/system/node/online", "r");
+  if (!f)
+    return 1;
+  int highest = 0, n = 0;
+  while (fscanf(f, "%d", &n) == 1) {
+    highest = max(highest, n);
+    if (fgetc(f) == EOF)
+      break;
+  }
+  fclose(f);
+  return highest + 1;
+}
+
+SlabAllocator::SlabAllocator(uint64_t limit, bool huge_pages, int numa_node)
+    : limit_(limit), huge_pages_(huge_pages), numa_node_(numa_node),
+      next_page_(NULL),
+      arena_end_(NULL), free_pages_(NULL), mapped_(0), huge_mapped_(0),
+      malloc_bytes_(0) {
+  size_t size = kMinChunkSize;
+  while (true) {
+    SlabClass* c = new SlabClass;
+    c->chunk_size = min(size, kMaxChunkSize);
+    c->chunks_per_page = kMaxChunkSize / c->chunk_size;
+    classes_.push_back(c);
+    if (c->chunk_size == kMaxChunkSize)
+      break;
+    size = RoundUp(static_cast<size_t>(size * kChunkGrowth), kChunkAlign);
+  }
+  CHECK(classes_.size() < kMallocClass);
+}
+
+SlabAllocator::~SlabAllocator() {
+  for (int i = 0; i < arenas_.size(); ++i) {
+    munmap(arenas_[i].first, arenas_[i].second);
+  }
+  for (int i = 0; i < classes_.size(); ++i) {
+    delete classes_[i];
+  }
+}
+
+void* SlabAllocator::Allocate(size_t size, uint8_t* slab_class) {
+  if (size <= kMaxChunkSize) {
+    // Smallest class which fits, classes are sorted by size.
+    int lo = 0, hi = classes_.size() - 1;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (classes_[mid]->chunk_size < size) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    SlabClass* c = classes_[lo];
+    lock_guard<mutex> l(c->m);
+    SlabPage* page = c->partial;
+    if (!page) {
+      page = NewPage(lo);
+      if (page) {
+        Link(c, page);
+        ++c->pages;
+      }
+    }
+    if (page) {
+      void* chunk = page->free_list;
+      if (chunk) {
+        page->free_list = *static_cast<void**>(chunk);
+      } else {
+        chunk = reinterpret_cast<char*>(page) + kPageHeaderSize +
+                page->carved * c->chunk_size;
+        ++page->carved;
+      }
+      ++page->used;
+      ++c->used;
+      if (page->used == c->chunks_per_page)
+        Unlink(c, page);  // Full.
+      *slab_class = lo;
+      return chunk;
+    }
+    // Out of pages. Falls through to malloc.
+  }
+
+  size_t total = kMallocHeaderSize + size;
+  MallocHeader* header = static_cast<MallocHeader*>(malloc(total));
+  CHECK(header);
+  header->owner = this;
+  header->size = malloc_usable_size(header);
+  {
+    lock_guard<mutex> l(pool_m_);
+    malloc_bytes_ += header->size;
+  }
+  *slab_class = kMallocClass;
+  return reinterpret_cast<char*>(header) + kMallocHeaderSize;
+}
+
+void SlabAllocator::Free(void* chunk, uint8_t slab_class) {
+  if (slab_class == kMallocClass) {
+    MallocHeader* header = reinterpret_cast<MallocHeader*>(
+        static_cast<char*>(chunk) - kMallocHeaderSize);
+    {
+      lock_guard<mutex> l(header->owner->pool_m_);
+      header->owner->malloc_bytes_ -= header->size;
+    }
+    free(header);
+    return;
+  }
+  SlabPage* page = PageOf(chunk);
+  page->owner->FreeChunk(page, chunk);
+}
+
+size_t SlabAllocator::ChunkSize(const void* chunk, uint8_t slab_class) {
+  if (slab_class == kMallocClass) {
+    return reinterpret_cast<const MallocHeader*>(
+        static_cast<const char*>(chunk) - kMallocHeaderSize)->size;
+  }
+  SlabPage* page = PageOf(chunk);
+  return page->owner->classes_[slab_class]->chunk_size;
+}
+
+void SlabAllocator::FreeChunk(SlabPage* page, void* chunk) {
+  SlabClass* c = classes_[page->slab_class];
+  bool release = false;
+  {
+    lock_guard<mutex> l(c->m);
+    if (page->used == c->chunks_per_page)
+      Link(c, page);  // Was full, has room again.
+    *static_cast<void**>(chunk) = page->free_list;
+    page->free_list = chunk;
+    --page->used;
+    --c->used;
+    if (page->used == 0) {
+      Unlink(c, page);
+      --c->pages;
+      release = true;
+    }
+  }
+  if (release)
+    ReleasePage(page);
+}
+
+SlabPage* SlabAllocator::NewPage(int slab_class) {
+  lock_guard<mutex> l(pool_m_);
+  SlabPage* page = free_pages_;
+  if (page) {
+    free_pages_ = page->next;
+  } else {
+    if (next_page_ == arena_end_ && !MapArena())
+      return NULL;
+    page = reinterpret_cast<SlabPage*>(next_page_);
+    next_page_ += kSlabPageSize;
+  }
+  page->owner = this;
+  page->slab_class = slab_class;
+  page->used = 0;
+  page->carved = 0;
+  page->free_list = NULL;
+  page->prev = NULL;
+  page->next = NULL;
+  return page;
+}
+
+void SlabAllocator::ReleasePage(SlabPage* page) {
+  lock_guard<mutex> l(pool_m_);
+  page->next = free_pages_;
+  free_pages_ = page;
+}
+
+bool SlabAllocator::MapArena() {
+  if (mapped_ >= limit_)
+    return false;
+  size_t size = min(kSlabArenaSize, RoundUp(limit_ - mapped_, kHugePageSize));
+
+  char* base = NULL;
+  bool huge = false;
+  if (huge_pages_) {
+    // Reserved huge pages, if the box has any. Always 2MB aligned.
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      base = static_cast<char*>(p);
+      huge = true;
+      arenas_.push_back(make_pair(base, size));
+    }
+  }
+  if (!base) {
+    // Map extra to align by hand, and give back the ends.
+    size_t padded = size + kHugePageSize;
+    void* p = mmap(NULL, padded, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return false;
+    char* raw = static_cast<char*>(p);
+    base = reinterpret_cast<char*>(
+        RoundUp(reinterpret_cast<uintptr_t>(raw), kHugePageSize));
+    if (base > raw)
+      munmap(raw, base - raw);
+    if (raw + padded > base + size)
+      munmap(base + size, raw + padded - (base + size));
+    if (huge_pages_) {
+      // Transparent huge pages instead.
+      madvise(base, size, MADV_HUGEPAGE);
+    }
+    arenas_.push_back(make_pair(base, size));
+  }
+
+  if (numa_node_ >= 0)
+    BindToNode(base, size, numa_node_);
+  mapped_ += size;
+  if (huge)
+    huge_mapped_ += size;
+  next_page_ = base;
+  arena_end_ = base + size;
+  return true;
+}
+
+void SlabAllocator::Unlink(SlabClass* c, SlabPage* page) {
+  if (page->prev) {
+    page->prev->next = page->next;
+  } else {
+    c->partial = page->next;
+  }
+  if (page->next)
+    page->next->prev = page->prev;
+  page->prev = NULL;
+  page->next = NULL;
+}
+
+void SlabAllocator::Link(SlabClass* c, SlabPage* page) {
+  page->prev = NULL;
+  page->next = c->partial;
+  if (c->partial)
+    c->partial->prev = page;
+  c->partial = page;
+}
+
+void SlabAllocator::PopulateStats(memcache_router::Stats* stats) const {
+  for (int i = 0; i < classes_.size(); ++i) {
+    const SlabClass* c = classes_[i];
+    lock_guard<mutex> l(c->m);
+    if (c->pages == 0)
+      continue;
+    memcache_router::SlabClassStats* s = stats->add_slab_classes();
+    s->set_chunk_size(c->chunk_size);
+    s->set_pages(c->pages);
+    s->set_chunks_used(c->used);
+    s->set_chunks_free(c->pages * c->chunks_per_page - c->used);
+    if (numa_node_ >= 0)
+      s->set_numa_node(numa_node_);
+  }
+  lock_guard<mutex> l(pool_m_);
+  // Other nodes' allocators add to the same totals.
+  stats->set_slab_mapped_bytes(stats->slab_mapped_bytes() + mapped_);
+  stats->set_slab_huge_page_bytes(
+      stats->slab_huge_page_bytes() + huge_mapped_);
+  stats->set_slab_malloc_bytes(stats->slab_malloc_bytes() + malloc_bytes_);
+}
@@ -0,0 +1,107 @@
+#ifndef MEMCACHE_ROUTER_SLAB_H
+#define MEMCACHE_ROUTER_SLAB_H
+
+/*
+ * Size classed slab allocator for cache entries, in the style of
+ * memcached's.
+ *
+ * Memory comes from a few large arenas, mapped up front and optionally
+ * backed by huge pages. Arenas are cut into 1MB pages, and each page serves
+ * chunks of a single size class; classes grow by a factor of 1.125. Freed
+ * chunks go back on their page's free list, and a page whose chunks are all
+ * free goes back to the shared pool, for any class to take. So eviction
+ * never goes through malloc, and the bytes a chunk really takes up are
+ * known exactly.
+ *
+ * Allocations too big for a page, or made once the arenas are used up, fall
+ * back to malloc, and are accounted with malloc_usable_size.
+ *
+ * An allocator can be tied to a NUMA node, in which case its arenas prefer
+ * that node's memory.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "memdata.pb.h"
+using namespace std;
+
+const size_t kSlabPageSize = 1 << 20;
+const size_t kSlabArenaSize = 64 << 20;
+const uint8_t kMallocClass = 255;  // Not from a slab.
+
+class SlabAllocator;
+
+// NUMA nodes of the box, 1 if it isn't NUMA.
+int NumaNodes();
+
+// Sits at the start of every page, which is kSlabPageSize aligned, so a
+// chunk finds its page by masking its address.
+struct SlabPage {
+  SlabAllocator* owner;
+  int slab_class;
+  int used;  // Chunks handed out.
+  int carved;  // Chunks ever handed out, the rest are untouched.
+  void* free_list;  // Chunks given back.
+  // On the class's list of pages with room left.
+  SlabPage* prev;
+  SlabPage* next;
+};
+
+class SlabAllocator {
+ public:
+  // Arenas get mapped as needed, up to limit bytes. A negative numa_node
+  // leaves placement to the kernel.
+  SlabAllocator(uint64_t limit, bool huge_pages, int numa_node = -1);
+  ~SlabAllocator();
+
+  // Never fails. Sets *slab_class to where the memory came from.
+  void* Allocate(size_t size, uint8_t* slab_class);
+  static void Free(void* chunk, uint8_t slab_class);
+
+  // Bytes an allocation really takes up.
+  static size_t ChunkSize(const void* chunk, uint8_t slab_class);
+
+  void PopulateStats(memcache_router::Stats* stats) const;
+
+ private:
+  struct SlabClass {
+    SlabClass() : chunk_size(0), chunks_per_page(0), partial(NULL), pages(0),
+                  used(0) {}
+
+    mutable mutex m;
+    size_t chunk_size;
+    int chunks_per_page;
+    SlabPage* partial;  // Pages with room left.
+    uint64_t pages;
+    uint64_t used;
+  };
+
+  void FreeChunk(SlabPage* page, void* chunk);
+  // Returns NULL once the limit is reached.
+  SlabPage* NewPage(int slab_class);
+  void ReleasePage(SlabPage* page);
+  // NOTE: These should be called with pool_m_ acquired.
+  bool MapArena();
+
+  static void Unlink(SlabClass* c, SlabPage* page);
+  static void Link(SlabClass* c, SlabPage* page);
+
+  const uint64_t limit_;
+  const bool huge_pages_;
+  const int numa_node_;
+  vector<SlabClass*> classes_;
+
+  mutable mutex pool_m_;
+  vector<pair<char*, size_t> > arenas_;  // GUARDED_BY pool_m_
+  char* next_page_;  // Not carved out of the last arena yet.
+  char* arena_end_;
+  SlabPage* free_pages_;  // Linked through next.
+  uint64_t mapped_;
+  uint64_t huge_mapped_;
+  uint64_t malloc_bytes_;
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kMagic[8] = {'C', 'M', 'R', 'S', 'N', 'A', 'P', '1'};
+const size_t kFlushBytes = 1 << 20;
+
+struct Header {
+  char magic[8];
+  uint64_t created;  // Unix time.
+};
+
+struct Trailer {
+  uint64_t records;
+  char magic[8];
+};
+
+}  // namespace
+
+SnapshotWriter::SnapshotWriter(const string& path)
+    : path_(path), tmp_path_(path + ".tmp"), records_(0) {
+  fd_ = open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+             0644);
+  if (fd_ < 0) {
+    cerr << "Can't create snapshot " << tmp_path_ << ": " << strerror(errno)
+         << endl;
+    return;
+  }
+  buffer_.reserve(kFlushBytes + (64 << 10));
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.created = time(NULL);
+  Write(&header, sizeof(header));
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  if (fd_ >= 0) {
+    close(fd_);
+    unlink(tmp_path_.c_str());
+  }
+}
+
+void SnapshotWriter::Append(const char* key, uint32_t key_size,
+                            const char* value, uint32_t value_size,
+                            uint32_t flags, uint64_t cas, uint64_t expire_at,
+                            bool compressed) {
+  SnapshotRecord record;
+  record.cas = cas;
+  record.expire_at = expire_at;
+  record.flags = flags;
+  record.key_size = key_size;
+  record.value_size = value_size;
+  record.compressed = compressed;
+  Write(&record, sizeof(record));
+  Write(key, key_size);
+  Write(value, value_size);
+  static const char kPadding[8] = {0};
+  Write(kPadding, record.Size() - sizeof(record) - key_size - value_size);
+  ++records_;
+}
+
+bool SnapshotWriter::Commit() {
+  Trailer trailer;
+  trailer.records = records_;
+  memcpy(trailer.magic, kMagic, sizeof(kMagic));
+  Write(&trailer, sizeof(trailer));
+  Flush();
+  if (fd_ >= 0 && fsync(fd_) != 0)
+    Fail("sync");
+  if (fd_ < 0)
+    return false;
+  close(fd_);
+  fd_ = -1;
+  if (rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+    cerr << "Can't move snapshot to " << path_ << ": " << strerror(errno)
+         << endl;
+    unlink(tmp_path_.c_str());
+    return false;
+  }
+  return true;
+}
+
+void SnapshotWriter::Write(const void* data, size_t size) {
+  if (fd_ < 0)
+    return;
+  buffer_.append(static_cast<const char*>(data), size);
+  if (buffer_.size() >= kFlushBytes)
+    Flush();
+}
+
+void SnapshotWriter::Flush() {
+  size_t done = 0;
+  while (fd_ >= 0 && done < buffer_.size()) {
+    ssize_t written = write(fd_, buffer_.data() + done,
+                            buffer_.size() - done);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0) {
+      Fail("write");
+      break;
+    }
+    done += written;
+  }
+  buffer_.clear();
+}
+
+void SnapshotWriter::Fail(const char* what) {
+  cerr << "Snapshot " << tmp_path_ << " failed to " << what << ": "
+       << strerror(errno) << endl;
+  close(fd_);
+  fd_ = -1;
+  unlink(tmp_path_.c_str());
+}
+
+SnapshotReader::SnapshotReader() : data_(NULL), size_(0) {}
+
+SnapshotReader::~SnapshotReader() {
+  if (data_)
+    munmap(data_, size_);
+}
+
+bool SnapshotReader::Open(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    cerr << "No snapshot at " << path << ": " << strerror(errno) << endl;
+    return false;
+  }
+  struct stat st;
+  bool mapped = false;
+  if (fstat(fd, &st) == 0 &&
+      st.st_size >= static_cast<off_t>(sizeof(Header) + sizeof(Trailer))) {
+    size_ = st.st_size;
+    data_ = mmap(NULL, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    mapped = data_ != MAP_FAILED;
+    if (!mapped)
+      data_ = NULL;
+  }
+  close(fd);
+  if (!mapped) {
+    cerr << "Can't map snapshot " << path << endl;
+    return false;
+  }
+  // Read front to back, as the records get indexed.
+  madvise(data_, size_, MADV_SEQUENTIAL);
+
+  const char* begin = static_cast<const char*>(data_);
+  const char* end = begin + size_ - sizeof(Trailer);
+  const Header* header = reinterpret_cast<const Header*>(begin);
+  const Trailer* trailer = reinterpret_cast<const Trailer*>(end);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      memcmp(trailer->magic, kMagic, sizeof(kMagic)) != 0) {
+    cerr << "Not a complete snapshot: " << path << endl;
+    return false;
+  }
+
+  records_.reserve(min(trailer->records,
+                       static_cast<uint64_t>(size_ / sizeof(SnapshotRecord))));
+  const char* p = begin + sizeof(Header);
+  while (p + sizeof(SnapshotRecord) <= end) {
+    const SnapshotRecord* record = reinterpret_cast<const SnapshotRecord*>(p);
+    if (record->Size() > static_cast<size_t>(end - p))
+      break;
+    records_.push_back(record);
+    p += record->Size();
+  }
+  if (p != end || records_.size() != trailer->records) {
+    cerr << "Corrupt snapshot: " << path << endl;
+    records_.clear();
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,105 @@
+#ifndef MEMCACHE_ROUTER_SNAPSHOT_H
+#define MEMCACHE_ROUTER_SNAPSHOT_H
+
+/*
+ * Snapshot of the router cache on disk, so a restarted router comes up
+ * warm instead of sending all its misses to memcached at once.
+ *
+ * A snapshot is a header, then records appended one after the other, then
+ * a trailer with the record count. A record is a fixed size header followed
+ * by the key and the value, padded to 8 bytes. Expiry is kept as unix time,
+ * as the cache's own clock starts over with the process.
+ *
+ * Writers append to path.tmp, and rename it over path once it's complete
+ * and synced, so a router dying halfway leaves the previous snapshot in
+ * place. Readers map the whole file, and find the records by hopping over
+ * their headers, so they can be handed out in ranges to parallel loaders.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct SnapshotRecord {
+  const char* key() const {
+    return reinterpret_cast<const char*>(this + 1);
+  }
+
+  const char* value() const {
+    return key() + key_size;
+  }
+
+  // Bytes taken up in the file, with the padding.
+  size_t Size() const {
+    return (sizeof(SnapshotRecord) + key_size + value_size + 7) & ~7ULL;
+  }
+
+  uint64_t cas;
+  uint64_t expire_at;  // Unix time, 0 for never.
+  uint32_t flags;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t compressed;  // The value is as the cache keeps compressed ones.
+};
+
+class SnapshotWriter {
+ public:
+  explicit SnapshotWriter(const string& path);
+  // Drops the temporary file, unless committed.
+  ~SnapshotWriter();
+
+  // False once anything failed to write. Appends are ignored from then on.
+  bool ok() const {
+    return fd_ >= 0;
+  }
+
+  void Append(const char* key, uint32_t key_size, const char* value,
+              uint32_t value_size, uint32_t flags, uint64_t cas,
+              uint64_t expire_at, bool compressed);
+  // Writes the trailer, syncs, and moves the file in place of path.
+  bool Commit();
+
+  uint64_t records() const {
+    return records_;
+  }
+
+ private:
+  void Write(const void* data, size_t size);
+  void Flush();
+  void Fail(const char* what);
+
+  const string path_;
+  const string tmp_path_;
+  int fd_;
+  string buffer_;
+  uint64_t records_;
+};
+
+class SnapshotReader {
+ public:
+  SnapshotReader();
+  ~SnapshotReader();
+
+  // Maps the snapshot and indexes its records. False if there's none, or
+  // it isn't a complete snapshot.
+  bool Open(const string& path);
+
+  const vector<const SnapshotRecord*>& records() const {
+    return records_;
+  }
+
+  size_t bytes() const {
+    return size_;
+  }
+
+ private:
+  SnapshotReader(const SnapshotReader&);
+  void operator=(const SnapshotReader&);
+
+  void* data_;
+  size_t size_;
+  vector<const SnapshotRecord*> records_;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel(uint32_t now) : now_(now) {
+  for (int level = 0; level < kLevels; ++level) {
+    for (int i = 0; i < kSlots; ++i) {
+      slots_[level][i].prev = &slots_[level][i];
+      slots_[level][i].next = &slots_[level][i];
+    }
+  }
+}
+
+void TimerWheel::Add(TimerLink* link) {
+  uint32_t expire_at = link->expire_at;
+  if (expire_at <= now_)
+    expire_at = now_ + 1;
+
+  // The lowest level whose span covers the delay. A slot of level l comes
+  // due when the ticks reach its start, which is never past expire_at.
+  uint64_t delay = expire_at - now_;
+  int level = 0;
+  while (level < kLevels - 1 &&
+         delay >= (1ULL << ((level + 1) * kSlotBits))) {
+    ++level;
+  }
+  if (delay >= (1ULL << (kLevels * kSlotBits))) {
+    // Beyond the last level. Parks in the slot furthest out, and gets
+    // spread down again from there.
+    expire_at = now_ + (1U << (kLevels * kSlotBits)) - 1;
+  }
+  Append(Slot(level, expire_at), link);
+}
+
+void TimerWheel::Remove(TimerLink* link) {
+  if (!link->linked())
+    return;
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link->prev = NULL;
+  link->next = NULL;
+}
+
+void TimerWheel::Advance(uint32_t now, vector<TimerLink*>* expired) {
+  vector<TimerLink*> cascade;
+  while (now_ < now) {
+    ++now_;
+    // Highest level first, so its timers can land in slots of the levels
+    // below which are about to be spread out too.
+    for (int level = kLevels - 1; level > 0; --level) {
+      uint32_t span = 1U << (level * kSlotBits);
+      if (now_ % span != 0)
+        continue;
+      cascade.clear();
+      Take(Slot(level, now_), &cascade);
+      for (int i = 0; i < cascade.size(); ++i) {
+        if (cascade[i]->expire_at <= now_) {
+          expired->push_back(cascade[i]);
+        } else {
+          Add(cascade[i]);
+        }
+      }
+    }
+    Take(Slot(0, now_), expired);
+  }
+}
+
+void TimerWheel::Append(TimerLink* head, TimerLink* link) {
+  link->prev = head->prev;
+  link->next = head;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+void TimerWheel::Take(TimerLink* head, vector<TimerLink*>* links) {
+  TimerLink* link = head->next;
+  while (link != head) {
+    TimerLink* next = link->next;
+    link->prev = NULL;
+    link->next = NULL;
+    links->push_back(link);
+    link = next;
+  }
+  head->prev = head;
+  head->next = head;
+}
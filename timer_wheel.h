@@ -0,0 +1,70 @@
+#ifndef MEMCACHE_ROUTER_TIMER_WHEEL_H
+#define MEMCACHE_ROUTER_TIMER_WHEEL_H
+
+/*
+ * Hierarchical timer wheel, with a one second tick.
+ *
+ * Four levels of 64 slots each, where a slot of level l spans 64^l
+ * seconds, so level 0 holds what expires within the next minute, and the
+ * last level reaches out about six years. Timers are intrusive links, so
+ * adding and removing one is O(1) and never allocates. When the lower
+ * levels wrap around, the slot of the level above which just came due is
+ * spread back down over them.
+ *
+ * Not thread safe, meant to be owned by whoever serializes the writers of
+ * the timed objects.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+// Embedded in whatever is timed.
+struct TimerLink {
+  TimerLink() : prev(NULL), next(NULL), expire_at(0) {}
+
+  bool linked() const {
+    return next != NULL;
+  }
+
+  TimerLink* prev;
+  TimerLink* next;
+  uint32_t expire_at;  // In ticks, 0 for never.
+};
+
+class TimerWheel {
+ public:
+  // Ticks start at now.
+  explicit TimerWheel(uint32_t now);
+
+  uint32_t now() const {
+    return now_;
+  }
+
+  // link->expire_at must be set. Timers already due fire on the next tick.
+  void Add(TimerLink* link);
+  void Remove(TimerLink* link);
+
+  // Ticks up to now, and appends the timers which came due.
+  void Advance(uint32_t now, vector<TimerLink*>* expired);
+
+ private:
+  static const int kLevels = 4;
+  static const int kSlotBits = 6;
+  static const int kSlots = 1 << kSlotBits;
+
+  // Sentinel of the circular list of a slot.
+  TimerLink* Slot(int level, uint32_t tick) {
+    return &slots_[level][(tick >> (level * kSlotBits)) & (kSlots - 1)];
+  }
+
+  static void Append(TimerLink* head, TimerLink* link);
+  // Moves the slot's timers out to the list.
+  static void Take(TimerLink* head, vector<TimerLink*>* links);
+
+  uint32_t now_;  // Last tick processed.
+  TimerLink slots_[kLevels][kSlots];
+};
+
+#endif
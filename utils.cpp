@@ -1,5 +1,6 @@
 #include "utils.h"
 
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <zmq.h>
@@ -18,4 +19,64 @@ void SendHelper(void* worker, const string& data, int flags) {
   CHECK(rc == data.size());
 }
 
+void SerializeToMessage(const google::protobuf::MessageLite& message,
+                        zmq_msg_t* msg) {
+  int size = message.ByteSize();
+  int rc = zmq_msg_init_size(msg, size);
+  CHECK(rc == 0);
+  uint8_t* start = static_cast<uint8_t*>(zmq_msg_data(msg));
+  uint8_t* end = message.SerializeWithCachedSizesToArray(start);
+  CHECK(end - start == size);
+}
+
+void SendMessage(void* worker, const google::protobuf::MessageLite& message,
+                 int flags) {
+  zmq_msg_t msg;
+  SerializeToMessage(message, &msg);
+  int size = zmq_msg_size(&msg);
+  int rc = zmq_msg_send(&msg, worker, flags);
+  if (rc == -1) {
+    cerr << "zmq errno: " << zmq_errno() << endl;
+  }
+  CHECK(rc == size);
+}
+
+Flags::Flags(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    string arg(argv[i]);
+    if (arg.compare(0, 2, "--") != 0) {
+      positional_.push_back(arg);
+      continue;
+    }
+    size_t eq = arg.find('=');
+    if (eq == string::npos) {
+      values_[arg.substr(2)] = "1";  // Plain --name means true.
+    } else {
+      values_[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+  }
+}
+
+int Flags::GetInt(const string& name, int default_value) const {
+  auto itr = values_.find(name);
+  if (itr == values_.end())
+    return default_value;
+  return atoi(itr->second.c_str());
+}
+
+double Flags::GetDouble(const string& name, double default_value) const {
+  auto itr = values_.find(name);
+  if (itr == values_.end())
+    return default_value;
+  return atof(itr->second.c_str());
+}
+
+string Flags::GetString(const string& name,
+                        const string& default_value) const {
+  auto itr = values_.find(name);
+  if (itr == values_.end())
+    return default_value;
+  return itr->second;
+}
+
 }  // router_utils
@@ -1,11 +1,17 @@
 #ifndef MEMCACHE_ROUTER_UTILS_H
 #define MEMCACHE_ROUTER_UTILS_H
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <climits>
 #include <iostream>
+#include <map>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
+#include <zmq.h>
 
 #include "memdata.pb.h"
 using namespace std;
@@ -24,6 +30,39 @@ namespace router_utils {
 
 void SendHelper(void* worker, const string& data, int flags);
 
+// Serializes message straight into a freshly sized zmq message, which saves
+// the copy through a temporary string. msg must not be initialized.
+void SerializeToMessage(const google::protobuf::MessageLite& message,
+                        zmq_msg_t* msg);
+
+// Same as above, and sends it.
+void SendMessage(void* worker, const google::protobuf::MessageLite& message,
+                 int flags);
+
+// Parses --name=value command line flags. Anything not starting with "--"
+// is kept as a positional argument, in order.
+class Flags {
+ public:
+  Flags(int argc, char* argv[]);
+
+  int GetInt(const string& name, int default_value) const;
+  double GetDouble(const string& name, double default_value) const;
+  string GetString(const string& name, const string& default_value) const;
+
+  const vector<string>& positional() const {
+    return positional_;
+  }
+
+ private:
+  map<string, string> values_;
+  vector<string> positional_;
+};
+
+inline int64_t NowMicros() {
+  return chrono::duration_cast<chrono::microseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 // This class is not thread safe.
 struct Timer {
   Timer() {
@@ -61,6 +100,106 @@ struct Stats {
   uint64_t value;
 };
 
+// Lock free version of Stats, for counters which get hit by every packet
+// from many threads. Counter and value are updated independently, so a
+// reader may see them off by one increment.
+struct AtomicStats {
+  AtomicStats() : counter(0), value(0) {}
+
+  void Increment(int x) {
+    value.fetch_add(x, memory_order_relaxed);
+    counter.fetch_add(1, memory_order_relaxed);
+  }
+
+  void Set(memcache_router::Breakdown* breakdown) const {
+    uint64_t c = counter.load(memory_order_relaxed);
+    uint64_t v = value.load(memory_order_relaxed);
+    breakdown->set_average(c == 0 ? 0 : static_cast<double>(v) / c);
+    breakdown->set_count(c);
+  }
+
+  atomic<uint64_t> counter;
+  atomic<uint64_t> value;
+};
+
+// Lock free log-linear histogram of latencies in microseconds. Every power
+// of 2 is split into kSubBuckets, so buckets are at most 12.5% wide, which
+// is plenty to steer on percentiles.
+class LatencyHistogram {
+ public:
+  LatencyHistogram() {
+    Reset();
+  }
+
+  void Increment(int usecs) {
+    buckets_[BucketFor(usecs < 0 ? 0 : usecs)].fetch_add(
+        1, memory_order_relaxed);
+  }
+
+  // Returns the upper bound of the bucket holding the given percentile,
+  // with p in [0, 1]. Returns 0 if there are no samples.
+  int Percentile(double p) const {
+    uint64_t total = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      total += buckets_[i].load(memory_order_relaxed);
+    }
+    if (total == 0)
+      return 0;
+    uint64_t target = static_cast<uint64_t>(p * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      seen += buckets_[i].load(memory_order_relaxed);
+      if (seen > target)
+        return UpperBound(i);
+    }
+    return UpperBound(kNumBuckets - 1);
+  }
+
+  uint64_t Count() const {
+    uint64_t total = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      total += buckets_[i].load(memory_order_relaxed);
+    }
+    return total;
+  }
+
+  // Samples racing with Reset may or may not survive it.
+  void Reset() {
+    for (int i = 0; i < kNumBuckets; ++i) {
+      buckets_[i].store(0, memory_order_relaxed);
+    }
+  }
+
+ private:
+  static const int kSubBucketBits = 3;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+  static const int kNumBuckets = 30 * kSubBuckets;  // Up to ~2^32 us.
+
+  static int BucketFor(uint32_t v) {
+    if (v < kSubBuckets)
+      return v;
+    int shift = 31 - __builtin_clz(v) - kSubBucketBits;
+    int bucket = (shift + 1) * kSubBuckets + (v >> shift) - kSubBuckets;
+    return bucket < kNumBuckets ? bucket : kNumBuckets - 1;
+  }
+
+  // 64 bits, as the bounds of the top buckets don't fit in an int.
+  static uint64_t LowerBound(int bucket) {
+    if (bucket < kSubBuckets)
+      return bucket;
+    int shift = bucket / kSubBuckets - 1;
+    return static_cast<uint64_t>(kSubBuckets + bucket % kSubBuckets) << shift;
+  }
+
+  // Clamped to the largest sample Increment takes.
+  static int UpperBound(int bucket) {
+    return static_cast<int>(min<uint64_t>(LowerBound(bucket + 1) - 1,
+                                          INT_MAX));
+  }
+
+  atomic<uint64_t> buckets_[kNumBuckets];
+};
+
 class ThreadSafeStats {
  public:
   void Merge(const Stats& s) {